@@ -3,7 +3,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <pthread.h>
 #include "types.h"
 #include "defs.h"
 #include "param.h"
@@ -12,47 +17,930 @@
 #include "proc.h"
 #include "fcntl.h"
 #include "user.h"
+#include "buf.h"
+#include "file.h"
 
 int fs;
+uint bshift = 9;   // BSIZE is 1 << bshift - see setbsize
+uchar *fsmap;      // whole image when opened with openfs_mmap, else 0
+size_t fsmapsize;
 struct cpu cpus[NCPU];
+__thread struct proc *curr_proc;  // each thread runs as its own process
 
 void panic(char *s) {
     printf("%s\n", s);
     exit(1);
 }
 
-int bread(uint block, char *buf) {
-    int off = lseek(fs, block*BSIZE, SEEK_SET);
-    if (off < 0)
-        panic("bread lseek fail");
-    //printf("off : %d\n", off);
-    int sz = read(fs, buf, BSIZE);
+/*
+ * Buffer cache.
+ *
+ * The buffer cache is a hashed, LRU list of buf structures holding
+ * cached copies of disk block contents. Caching disk blocks in memory
+ * reduces the number of disk reads and also provides a synchronization
+ * point for disk blocks used by multiple parts of tinyfs.
+ *
+ * Interface:
+ * * To get a buffer for a particular disk block, call bread.
+ * * After changing buffer data, call bwrite to mark it dirty.
+ * * When done with the buffer, call brelse.
+ * * Do not use the buffer after calling brelse.
+ * * Only one caller at a time can use a buffer,
+ *     so do not keep them longer than necessary.
+ *
+ * bcachelock guards the cache's lists, flags and counters. A thread
+ * that wants a B_BUSY buffer waits on bcachecond until brelse frees it.
+ * Disk I/O is done without the lock, on buffers the thread holds busy.
+ *
+ * Dirty buffers are written back when they are evicted to make room
+ * for another block, and by bflush, which closefs calls. bflusher
+ * starts a thread that also writes them back in the background, once
+ * they have been dirty for a while or too much of the cache is dirty.
+ *
+ * With a log (log.c), log_write pins a buffer with bpin until its
+ * transaction commits. A pinned buffer is neither evicted nor flushed,
+ * so the block cannot reach its home location before the log does.
+ *
+ * Newly allocated blocks are marked fresh with bfresh rather than
+ * zeroed on disk. A fresh block reads as zeros without touching the
+ * disk, and stops being fresh once its buffer is written back or the
+ * block is freed (bunfresh). The marks are not kept on disk: blocks
+ * tfs_fallocate reserves are left unwritten and read as zeros by way
+ * of the inode instead - see iunwritten in fs.c.
+ *
+ * For delayed allocation (fs.c), bgetdelay hands out a buffer that
+ * holds file data with no disk block yet. Its owner keeps it busy
+ * until the data is copied under a real block and brelsedelay gives
+ * it back, so it is neither evicted nor flushed meanwhile. At most a
+ * quarter of the cache is held that way.
+ *
+ * bioqueue starts I/O threads that serve a disk queue, so several
+ * requests can be in flight at once. Reads and writes are then queued
+ * and waited for, readahead fills buffers without the caller waiting,
+ * and write-back queues every run before waiting for any.
+ *
+ * When the image is opened with openfs_mmap, b->data points straight
+ * at the block in the mapped image, so every buffer is valid without
+ * a read and changes land in the image as they are made. Nothing is
+ * written back on eviction; bsync and closefs msync the image.
+ */
+#define NBUCKET 61  // hash buckets in the buffer cache
+
+struct {
+    struct buf *buf;            // nbuf buffers allocated by binit
+    uchar *mem;                 // nbuf*BSIZE bytes of block data
+    uint nbuf;
+    uint bsize;                 // BSIZE when binit sized mem
+    // Linked list of all buffers, through prev/next.
+    // head.next is most recently used.
+    struct buf head;
+    struct buf *hash[NBUCKET];  // chains through hnext, keyed by sector
+    uint *fresh;                // bitmap of known-zero sectors, see bfresh
+    uint nsector;               // sectors in the image
+    uint ndirty;                // buffers with B_DIRTY set
+    uint ndelay;                // buffers out through bgetdelay
+    struct bcachestat stat;
+} bcache;
+// Kept out of bcache so binit and closefs can clear it.
+static pthread_mutex_t bcachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcachecond = PTHREAD_COND_INITIALIZER;
+
+// Background write-back - see bflusher. Guarded by bcachelock.
+static struct {
+    pthread_t thread;
+    pthread_cond_t cond;  // wakes the thread early
+    int on;
+    int stop;             // closefs wants the thread to exit
+    int all;              // write every dirty buffer on the next pass
+    uint maxage;          // ms a buffer may stay dirty
+    uint dirtypct;        // % of the cache that may be dirty
+} flusher = { .cond = PTHREAD_COND_INITIALIZER };
+
+// Milliseconds on a clock that only goes forward.
+static uint bnow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Set and clear B_DIRTY, keeping the count of dirty buffers and
+// when each became dirty. Caller holds bcachelock.
+static void setdirty(struct buf *b) {
+    if ((b->flags & B_DIRTY) == 0) {
+        b->flags |= B_DIRTY;
+        b->dirtied = bnow();
+        bcache.ndirty++;
+    }
+}
+
+static void setclean(struct buf *b) {
+    if (b->flags & B_DIRTY) {
+        b->flags &= ~B_DIRTY;
+        bcache.ndirty--;
+    }
+}
+
+static int overdirty(void) {
+    return bcache.ndirty * 100 > flusher.dirtypct * bcache.nbuf;
+}
+
+static int isfresh(uint sector) {
+    return sector < bcache.nsector &&
+           (bcache.fresh[sector/32] & (1u << (sector % 32)));
+}
+
+// Move the n buffers bp[0..n-1], which hold contiguous sectors,
+// between memory and disk with a single positional system call.
+// One block goes through pread/pwrite, a run through preadv/pwritev.
+// The buffers must be B_BUSY and bcachelock not held.
+static void diskio(struct buf **bp, int n, int write) {
+    struct iovec iov[MAXBIO];
+    off_t off = (off_t)bp[0]->sector * BSIZE;
+    ssize_t sz;
+    int i;
+
+    if (n > MAXBIO)
+        panic("diskio: too many blocks");
+    if (fsmap) {  // data already lives in the image; see bsync
+        pthread_mutex_lock(&bcachelock);
+        for (i = 0; i < n; i++) {
+            bp[i]->flags |= B_VALID;
+            setclean(bp[i]);
+        }
+        pthread_mutex_unlock(&bcachelock);
+        return;
+    }
+    if (n == 1) {
+        sz = write ? pwrite(fs, bp[0]->data, BSIZE, off)
+                   : pread(fs, bp[0]->data, BSIZE, off);
+    } else {
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = bp[i]->data;
+            iov[i].iov_len = BSIZE;
+        }
+        sz = write ? pwritev(fs, iov, n, off) : preadv(fs, iov, n, off);
+    }
     if (sz < 0)
-        panic("bread read fail");
-    //printf("sz : %d\n", sz);
+        panic(write ? "bwrite write fail" : "bread read fail");
+
+    pthread_mutex_lock(&bcachelock);
+    if (write) {
+        bcache.stat.diskwrites++;
+        bcache.stat.writebacks += n;
+        for (i = 0; i < n; i++) {
+            setclean(bp[i]);
+            if (isfresh(bp[i]->sector))  // the disk copy is current now
+                bcache.fresh[bp[i]->sector/32] &= ~(1u << (bp[i]->sector % 32));
+        }
+    } else {
+        bcache.stat.diskreads++;
+        for (i = 0; i < n; i++) {
+            ssize_t got = sz - i*BSIZE;  // bytes read into this block
+            if (got < 0)
+                got = 0;
+            if (got < BSIZE)  // past end of image
+                memset(bp[i]->data + got, 0, BSIZE - got);
+            bp[i]->flags |= B_VALID;
+        }
+    }
+    pthread_mutex_unlock(&bcachelock);
+}
+
+/*
+ * Disk queue.
+ *
+ * Requests are B_BUSY buffers marked B_QUEUED and chained through
+ * qnext in sector order. An I/O thread takes the first request and
+ * the ones after it for adjacent sectors in the same direction, up to
+ * MAXBIO, and moves them with one diskio. It then clears B_QUEUED,
+ * wakes waiters on bcachecond and calls each buffer's iodone.
+ * Without I/O threads, bstartio does the I/O itself.
+ */
+static struct {
+    struct buf *head;     // guarded by bcachelock
+    pthread_cond_t cond;  // wakes I/O threads
+    pthread_t thread[NIOTHREAD];
+    int nthread;
+    int stop;             // closefs wants the threads to exit
+} bioq = { .cond = PTHREAD_COND_INITIALIZER };
+
+static void *iothread(void *arg) {
+    struct buf *run[MAXBIO], *b;
+    void (*done[MAXBIO])(struct buf*);
+    int i, n, write;
+
+    pthread_mutex_lock(&bcachelock);
+    for (;;) {
+        while (bioq.head == 0 && !bioq.stop)
+            pthread_cond_wait(&bioq.cond, &bcachelock);
+        if (bioq.head == 0)  // stopping, and nothing is left
+            break;
+        write = bioq.head->flags & B_QWRITE;
+        n = 0;
+        b = bioq.head;
+        do {
+            run[n++] = b;
+            b = b->qnext;
+        } while (b && n < MAXBIO && b->sector == run[n-1]->sector + 1 &&
+                 (b->flags & B_QWRITE) == write);
+        bioq.head = b;
+        pthread_mutex_unlock(&bcachelock);
+
+        diskio(run, n, write != 0);
+
+        pthread_mutex_lock(&bcachelock);
+        for (i = 0; i < n; i++) {
+            done[i] = run[i]->iodone;
+            run[i]->iodone = 0;
+            run[i]->qnext = 0;
+            run[i]->flags &= ~(B_QUEUED | B_QWRITE);
+        }
+        pthread_cond_broadcast(&bcachecond);
+        pthread_mutex_unlock(&bcachelock);
+        for (i = 0; i < n; i++)
+            if (done[i])
+                done[i](run[i]);
+        pthread_mutex_lock(&bcachelock);
+    }
+    pthread_mutex_unlock(&bcachelock);
     return 0;
 }
 
-int bwrite(uint block, char *buf) {
-    int off = lseek(fs, block*BSIZE, SEEK_SET);
-    if (off < 0)
-        panic("bwrite lseek fail");
-    //printf("off : %d\n", off);
-    int sz = write(fs, buf, BSIZE);
-    if (sz < 0)
-        panic("bwrite write fail");
-    //printf("sz : %d\n", sz);
+// Start nthread I/O threads to serve the disk queue. Call after
+// openfs; closefs stops them once the queue is empty.
+void bioqueue(uint nthread) {
+    if (nthread == 0 || nthread > NIOTHREAD)
+        panic("bioqueue: bad thread count");
+    if (bioq.nthread)
+        panic("bioqueue: already running");
+    pthread_mutex_lock(&bcachelock);
+    bioq.stop = 0;
+    bioq.nthread = nthread;
+    pthread_mutex_unlock(&bcachelock);
+    for (uint i = 0; i < nthread; i++)
+        if (pthread_create(&bioq.thread[i], 0, iothread, 0) != 0)
+            panic("bioqueue: pthread_create");
+}
+
+static void bioqueuestop(void) {
+    int i;
+
+    if (bioq.nthread == 0)
+        return;
+    pthread_mutex_lock(&bcachelock);
+    bioq.stop = 1;
+    pthread_cond_broadcast(&bioq.cond);
+    pthread_mutex_unlock(&bcachelock);
+    for (i = 0; i < bioq.nthread; i++)
+        pthread_join(bioq.thread[i], 0);
+    pthread_mutex_lock(&bcachelock);
+    bioq.nthread = 0;
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Start moving the n B_BUSY buffers bp[0..n-1], which hold contiguous
+// sectors, between memory and disk. Queue them if there are I/O
+// threads, else do it now. Wait with bwaitio unless they have iodone.
+static void bstartio(struct buf **bp, int n, int write) {
+    struct buf **pp;
+    int i;
+
+    pthread_mutex_lock(&bcachelock);
+    if (bioq.nthread == 0 || fsmap) {
+        pthread_mutex_unlock(&bcachelock);
+        diskio(bp, n, write);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        bp[i]->flags |= B_QUEUED | (write ? B_QWRITE : 0);
+        for (pp = &bioq.head; *pp && (*pp)->sector < bp[i]->sector; pp = &(*pp)->qnext)
+            ;
+        bp[i]->qnext = *pp;
+        *pp = bp[i];
+    }
+    pthread_cond_signal(&bioq.cond);
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Wait until the I/O bstartio started on bp[0..n-1] is done.
+static void bwaitio(struct buf **bp, int n) {
+    pthread_mutex_lock(&bcachelock);
+    for (int i = 0; i < n; i++)
+        while (bp[i]->flags & B_QUEUED)
+            pthread_cond_wait(&bcachecond, &bcachelock);
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Move bp[0..n-1] between memory and disk and wait for it.
+static void bdiskio(struct buf **bp, int n, int write) {
+    bstartio(bp, n, write);
+    bwaitio(bp, n);
+}
+
+static void hashremove(struct buf *b) {
+    struct buf **pp = &bcache.hash[b->sector % NBUCKET];
+    for (; *pp; pp = &(*pp)->hnext)
+        if (*pp == b) {
+            *pp = b->hnext;
+            return;
+        }
+}
+
+// Allocate a cache of nbuf buffers. openfs calls binit(NBUF) if the
+// cache has not been set up, so call binit first to choose a capacity;
+// openfs sizes it again if the image has another block size.
+// breadv can hold MAXBIO buffers at once, so the cache needs more.
+void binit(uint nbuf) {
+    struct buf *b;
+
+    if (nbuf <= MAXBIO)
+        panic("binit: too few buffers");
+    free(bcache.buf);
+    free(bcache.mem);
+    memset(&bcache, 0, sizeof(bcache));
+    bcache.buf = calloc(nbuf, sizeof(struct buf));
+    bcache.mem = calloc(nbuf, BSIZE);
+    if (bcache.buf == 0 || bcache.mem == 0)
+        panic("binit: out of memory");
+    bcache.nbuf = nbuf;
+    bcache.bsize = BSIZE;
+
+    bcache.head.prev = &bcache.head;
+    bcache.head.next = &bcache.head;
+    for (b = bcache.buf; b < bcache.buf+nbuf; b++) {
+        b->next = bcache.head.next;
+        b->prev = &bcache.head;
+        b->dev = -1;
+        b->data = bcache.mem + (b - bcache.buf)*BSIZE;
+        bcache.head.next->prev = b;
+        bcache.head.next = b;
+    }
+}
+
+// Fill an invalid buffer for a fresh sector with zeros.
+static struct buf* bzerofill(struct buf *b) {
+    if ((b->flags & B_VALID) == 0 && isfresh(b->sector)) {
+        memset(b->data, 0, BSIZE);
+        b->flags |= B_VALID;
+        bcache.stat.zerofills++;
+    }
+    return b;
+}
+
+// Look through buffer cache for sector.
+// If not found, recycle the least recently used unbusy buffer,
+// writing it back first if it is dirty.
+// In either case, return a B_BUSY buffer, or 0 if wait is 0 and
+// that would mean waiting for another thread.
+static struct buf* bget1(uint sector, int wait) {
+    struct buf *b;
+
+    pthread_mutex_lock(&bcachelock);
+loop:
+    for (b = bcache.hash[sector % NBUCKET]; b; b = b->hnext) {
+        if (b->sector == sector && b->dev == ROOTDEV) {
+            if (b->flags & B_BUSY) {
+                if (!wait) {
+                    pthread_mutex_unlock(&bcachelock);
+                    return 0;
+                }
+                pthread_cond_wait(&bcachecond, &bcachelock);
+                goto loop;
+            }
+            b->flags |= B_BUSY;
+            bcache.stat.hits++;
+            bzerofill(b);
+            pthread_mutex_unlock(&bcachelock);
+            return b;
+        }
+    }
+
+    // Not cached; recycle the least recently used buffer.
+    for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+        if ((b->flags & (B_BUSY | B_LOG)) == 0) {
+            if (b->dev == ROOTDEV && (b->flags & B_DIRTY) && !fsmap) {
+                // Write it back without the lock, then look again:
+                // another thread may have cached sector meanwhile.
+                b->flags |= B_BUSY;
+                pthread_mutex_unlock(&bcachelock);
+                bdiskio(&b, 1, 1);
+                pthread_mutex_lock(&bcachelock);
+                b->flags &= ~B_BUSY;
+                pthread_cond_broadcast(&bcachecond);
+                goto loop;
+            }
+            if (b->dev == ROOTDEV) {
+                hashremove(b);
+                bcache.stat.evictions++;
+            }
+            bcache.stat.misses++;
+            setclean(b);  // a mapped image has it already
+            b->dev = ROOTDEV;
+            b->sector = sector;
+            b->flags = B_BUSY;
+            if (fsmap) {
+                if ((size_t)(sector+1)*BSIZE > fsmapsize)
+                    panic("bget: sector beyond image");
+                b->data = fsmap + (size_t)sector*BSIZE;
+                b->flags |= B_VALID;
+            }
+            b->hnext = bcache.hash[sector % NBUCKET];
+            bcache.hash[sector % NBUCKET] = b;
+            bzerofill(b);
+            pthread_mutex_unlock(&bcachelock);
+            return b;
+        }
+    }
+    // Every buffer is busy; wait for a brelse.
+    if (wait) {
+        pthread_cond_wait(&bcachecond, &bcachelock);
+        goto loop;
+    }
+    pthread_mutex_unlock(&bcachelock);
+    return 0;
+}
+
+// Return a B_BUSY buffer for sector, waiting if another thread has it.
+// The contents are only valid if B_VALID is set, so callers that
+// overwrite the whole block can use bget directly and skip the disk read.
+struct buf* bget(uint sector) {
+    return bget1(sector, 1);
+}
+
+// Return a zeroed B_BUSY buffer that is not tied to any sector, for
+// a file block that has no disk block yet, or 0 if a quarter of the
+// cache is already out this way or no buffer is free. Give it back
+// with brelsedelay.
+struct buf* bgetdelay(void) {
+    struct buf *b;
+
+    pthread_mutex_lock(&bcachelock);
+loop:
+    if (bcache.ndelay >= bcache.nbuf / 4) {
+        pthread_mutex_unlock(&bcachelock);
+        return 0;
+    }
+    for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+        if ((b->flags & (B_BUSY | B_LOG)) == 0) {
+            if (b->dev == ROOTDEV && (b->flags & B_DIRTY) && !fsmap) {
+                b->flags |= B_BUSY;
+                pthread_mutex_unlock(&bcachelock);
+                bdiskio(&b, 1, 1);
+                pthread_mutex_lock(&bcachelock);
+                b->flags &= ~B_BUSY;
+                pthread_cond_broadcast(&bcachecond);
+                goto loop;
+            }
+            if (b->dev == ROOTDEV) {
+                hashremove(b);
+                bcache.stat.evictions++;
+            }
+            setclean(b);
+            b->dev = -1;
+            b->sector = 0;
+            b->flags = B_BUSY | B_VALID;
+            b->data = bcache.mem + (b - bcache.buf)*BSIZE;  // not the image
+            memset(b->data, 0, BSIZE);
+            bcache.ndelay++;
+            pthread_mutex_unlock(&bcachelock);
+            return b;
+        }
+    }
+    pthread_mutex_unlock(&bcachelock);
+    return 0;
+}
+
+// Give back a buffer from bgetdelay.
+void brelsedelay(struct buf *b) {
+    pthread_mutex_lock(&bcachelock);
+    bcache.ndelay--;
+    b->flags &= ~B_VALID;
+    pthread_mutex_unlock(&bcachelock);
+    brelse(b);
+}
+
+// Note that sector was just allocated and must read as zeros.
+// Nothing is written: the next bread of it fills the buffer with zeros
+// instead of reading the disk, and only once that buffer is written
+// back does the block reach the disk. A mapped image is simply zeroed.
+void bfresh(uint sector) {
+    struct buf *b;
+
+    if (fsmap) {
+        if ((size_t)(sector+1)*BSIZE > fsmapsize)
+            panic("bfresh: sector beyond image");
+        memset(fsmap + (size_t)sector*BSIZE, 0, BSIZE);
+        return;
+    }
+    if (sector >= bcache.nsector)
+        panic("bfresh: sector beyond image");
+    pthread_mutex_lock(&bcachelock);
+loop:
+    for (b = bcache.hash[sector % NBUCKET]; b; b = b->hnext) {
+        if (b->sector == sector && b->dev == ROOTDEV) {
+            if (b->flags & B_BUSY) {  // e.g. bflush writing it back
+                pthread_cond_wait(&bcachecond, &bcachelock);
+                goto loop;
+            }
+            if (b->flags & B_LOG) {  // pinned: zero it, it is logged
+                memset(b->data, 0, BSIZE);
+                b->flags |= B_VALID;
+                setdirty(b);
+            } else {
+                b->flags &= ~B_VALID;  // old contents are garbage
+                setclean(b);
+            }
+        }
+    }
+    bcache.fresh[sector/32] |= 1u << (sector % 32);
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Note that sector was freed. It is no longer known to be zero once
+// it is allocated again - bfresh marks it then - so drop the mark.
+void bunfresh(uint sector) {
+    if (fsmap)
+        return;
+    pthread_mutex_lock(&bcachelock);
+    if (isfresh(sector))
+        bcache.fresh[sector/32] &= ~(1u << (sector % 32));
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Return a B_BUSY buf with the contents of the indicated disk sector.
+struct buf* bread(uint sector) {
+    struct buf *b = bget(sector);
+    if ((b->flags & B_VALID) == 0)
+        bdiskio(&b, 1, 0);
+    return b;
+}
+
+// Return in bp[0..n-1] B_BUSY bufs for up to n sectors starting at
+// sector, and how many there are. Only the first buffer is waited
+// for: holding some buffers while waiting for others could deadlock
+// two threads, so the run stops short at a buffer another thread has.
+// Each run of sectors that is not cached is read with one preadv,
+// all of them started before waiting for any.
+int breadv(uint sector, int n, struct buf **bp) {
+    int i, j;
+
+    if (n > MAXBIO)
+        panic("breadv: too many blocks");
+    bp[0] = bget(sector);
+    for (i = 1; i < n; i++)
+        if ((bp[i] = bget1(sector + i, 0)) == 0)
+            break;
+    n = i;
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && (bp[j]->flags & B_VALID) == 0; j++)
+            ;
+        if (j > i)
+            bstartio(bp + i, j - i, 0);
+        else
+            j++;
+    }
+    bwaitio(bp, n);
+    return n;
+}
+
+// Start reading the n sectors from sector without waiting, so the
+// bread or breadv that later wants them does not stall on the disk.
+// Sectors already valid in the buffer cache are left out. With I/O
+// threads, the first MAXBIO others are queued into buffers that are
+// released once read. Each remaining run gets one posix_fadvise
+// (madvise for a mapped image) that the kernel reads asynchronously.
+void breadahead(uint sector, int n) {
+    struct buf *b, *bp[MAXBIO];
+    int i, j, k = 0, got = 0, hint = 0, queue;
+    uchar cached[RAMAX];
+
+    if (n > RAMAX)
+        n = RAMAX;
+    if (sector >= bcache.nsector)
+        return;
+    if (sector + n > bcache.nsector)
+        n = bcache.nsector - sector;
+    pthread_mutex_lock(&bcachelock);
+    for (i = 0; i < n; i++) {
+        cached[i] = isfresh(sector + i);
+        for (b = bcache.hash[(sector + i) % NBUCKET]; b; b = b->hnext)
+            if (b->sector == sector + i && b->dev == ROOTDEV &&
+                (b->flags & B_VALID) && !fsmap)
+                cached[i] = 1;
+    }
+    queue = bioq.nthread && !fsmap;
+    pthread_mutex_unlock(&bcachelock);
+
+    for (i = 0; queue && i < n && got < MAXBIO; i++) {
+        if (cached[i] || (b = bget1(sector + i, 0)) == 0)
+            continue;
+        cached[i] = 1;
+        if (b->flags & B_VALID) {  // read meanwhile
+            brelse(b);
+            continue;
+        }
+        if (k > 0 && b->sector != bp[k-1]->sector + 1) {
+            bstartio(bp, k, 0);
+            k = 0;
+        }
+        b->iodone = brelse;
+        bp[k++] = b;
+        got++;
+    }
+    if (k > 0)
+        bstartio(bp, k, 0);
+
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && !cached[j]; j++)
+            ;
+        if (j == i) {
+            j++;
+            continue;
+        }
+        if (fsmap) {  // madvise wants a page-aligned start
+            size_t off = (size_t)(sector + i) * BSIZE;
+            size_t pg = off & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise(fsmap + pg, off - pg + (size_t)(j - i) * BSIZE, MADV_WILLNEED);
+        } else
+            posix_fadvise(fs, (off_t)(sector + i) * BSIZE,
+                          (off_t)(j - i) * BSIZE, POSIX_FADV_WILLNEED);
+        hint += j - i;
+    }
+    pthread_mutex_lock(&bcachelock);
+    bcache.stat.readaheads += got + hint;
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Mark b's contents as changed. The block is written back to disk
+// when the buffer is evicted or flushed. Must be B_BUSY.
+void bwrite(struct buf *b) {
+    if ((b->flags & B_BUSY) == 0)
+        panic("bwrite");
+    pthread_mutex_lock(&bcachelock);
+    b->flags |= B_VALID;
+    setdirty(b);
+    if (flusher.on && overdirty())
+        pthread_cond_signal(&flusher.cond);
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Write the n B_BUSY bufs bp[0..n-1], which must hold contiguous
+// sectors, to disk now with one pwritev.
+void bwritev(struct buf **bp, int n) {
+    for (int i = 0; i < n; i++) {
+        if ((bp[i]->flags & B_BUSY) == 0)
+            panic("bwritev");
+        if (bp[i]->sector != bp[0]->sector + i)
+            panic("bwritev: sectors not contiguous");
+    }
+    pthread_mutex_lock(&bcachelock);
+    for (int i = 0; i < n; i++)
+        bp[i]->flags |= B_VALID;
+    pthread_mutex_unlock(&bcachelock);
+    bdiskio(bp, n, 1);
+}
+
+// Write n whole blocks from src to the contiguous sectors starting at
+// sector, straight from the caller's memory with one pwrite. Cached
+// copies of those sectors are dropped rather than updated.
+void bwritedirect(uint sector, int n, char *src) {
+    struct buf *b;
+    uint s;
+
+    pthread_mutex_lock(&bcachelock);
+    for (s = sector; s < sector + n; s++) {
+    again:
+        for (b = bcache.hash[s % NBUCKET]; b; b = b->hnext) {
+            if (b->sector == s && b->dev == ROOTDEV && !fsmap) {
+                if (b->flags & B_BUSY) {
+                    pthread_cond_wait(&bcachecond, &bcachelock);
+                    goto again;
+                }
+                b->flags &= ~B_VALID;
+                setclean(b);
+            }
+        }
+        if (isfresh(s))
+            bcache.fresh[s/32] &= ~(1u << (s % 32));
+    }
+    if (!fsmap)
+        bcache.stat.diskwrites++;
+    pthread_mutex_unlock(&bcachelock);
+    if (fsmap) {
+        if ((size_t)(sector+n)*BSIZE > fsmapsize)
+            panic("bwritedirect: sector beyond image");
+        memmove(fsmap + (size_t)sector*BSIZE, src, (size_t)n*BSIZE);
+        return;
+    }
+    if (pwrite(fs, src, (size_t)n*BSIZE, (off_t)sector*BSIZE) < 0)
+        panic("bwritedirect write fail");
+}
+
+// Pin B_BUSY buffer b in the cache until bunpin, for the log.
+void bpin(struct buf *b) {
+    if ((b->flags & B_BUSY) == 0)
+        panic("bpin");
+    pthread_mutex_lock(&bcachelock);
+    b->flags |= B_LOG;
+    pthread_mutex_unlock(&bcachelock);
+}
+
+void bunpin(struct buf *b) {
+    if ((b->flags & B_BUSY) == 0)
+        panic("bunpin");
+    pthread_mutex_lock(&bcachelock);
+    b->flags &= ~B_LOG;
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Release a B_BUSY buffer.
+// Move to the head of the LRU list.
+void brelse(struct buf *b) {
+    if ((b->flags & B_BUSY) == 0)
+        panic("brelse");
+
+    pthread_mutex_lock(&bcachelock);
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    b->next = bcache.head.next;
+    b->prev = &bcache.head;
+    bcache.head.next->prev = b;
+    bcache.head.next = b;
+
+    b->flags &= ~B_BUSY;
+    pthread_cond_broadcast(&bcachecond);
+    pthread_mutex_unlock(&bcachelock);
+}
+
+static int sectorcmp(const void *a, const void *b) {
+    uint x = (*(struct buf **)a)->sector, y = (*(struct buf **)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+// Write the buffers that have been dirty for at least maxage ms back
+// to disk in sector order, coalescing adjacent sectors into one
+// pwritev each. Buffers another thread holds busy are left for a
+// later flush, and pinned ones for their commit. Return how many
+// were written.
+static int bwriteback(uint maxage) {
+    struct buf *b, **dirty;
+    int n = 0, i, j;
+    uint now = bnow();
+
+    if ((dirty = malloc(bcache.nbuf * sizeof(struct buf *))) == 0)
+        panic("bflush: out of memory");
+    pthread_mutex_lock(&bcachelock);
+    for (b = bcache.buf; b < bcache.buf+bcache.nbuf; b++)
+        if (b->dev == ROOTDEV && (b->flags & (B_DIRTY|B_BUSY|B_LOG)) == B_DIRTY &&
+            now - b->dirtied >= maxage) {
+            b->flags |= B_BUSY;
+            dirty[n++] = b;
+        }
+    pthread_mutex_unlock(&bcachelock);
+    qsort(dirty, n, sizeof(struct buf *), sectorcmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i+1; j < n && j-i < MAXBIO &&
+                      dirty[j]->sector == dirty[j-1]->sector + 1; j++)
+            ;
+        bstartio(dirty + i, j - i, 1);
+    }
+    bwaitio(dirty, n);
+    pthread_mutex_lock(&bcachelock);
+    for (i = 0; i < n; i++)
+        dirty[i]->flags &= ~B_BUSY;
+    pthread_cond_broadcast(&bcachecond);
+    pthread_mutex_unlock(&bcachelock);
+    free(dirty);
+    return n;
+}
+
+// Write every dirty buffer back to disk.
+void bflush(void) {
+    bwriteback(0);
+}
+
+// The flusher thread wakes every maxage/2 ms and writes back the
+// buffers dirty for maxage ms. When more than dirtypct% of the cache
+// is dirty, or bkick asks, it writes back all of them. If that wrote
+// nothing, the rest are busy or pinned, and it sleeps before retrying.
+static void *flushthread(void *arg) {
+    struct timespec ts;
+    uint all, ms;
+    int n = 0;
+
+    pthread_mutex_lock(&bcachelock);
+    while (!flusher.stop) {
+        ms = flusher.maxage/2 + 1;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        if (!flusher.all && (!overdirty() || n == 0))
+            pthread_cond_timedwait(&flusher.cond, &bcachelock, &ts);
+        if (flusher.stop)
+            break;
+        all = flusher.all || overdirty();
+        flusher.all = 0;
+        pthread_mutex_unlock(&bcachelock);
+        n = bwriteback(all ? 0 : flusher.maxage);
+        pthread_mutex_lock(&bcachelock);
+    }
+    pthread_mutex_unlock(&bcachelock);
     return 0;
 }
 
+// Start a thread that writes dirty buffers back in the background,
+// after maxage ms or once more than dirtypct% of the cache is dirty,
+// so bursts of writes finish at memory speed. Call after openfs;
+// closefs stops the thread. DIRTYAGE and DIRTYPCT are defaults.
+void bflusher(uint maxage, uint dirtypct) {
+    if (flusher.on)
+        panic("bflusher: already running");
+    if (bcache.nbuf == 0)
+        panic("bflusher: no file system");
+    pthread_mutex_lock(&bcachelock);
+    flusher.maxage = maxage;
+    flusher.dirtypct = dirtypct;
+    flusher.stop = flusher.all = 0;
+    flusher.on = 1;
+    pthread_mutex_unlock(&bcachelock);
+    if (pthread_create(&flusher.thread, 0, flushthread, 0) != 0)
+        panic("bflusher: pthread_create");
+}
+
+// Is the flusher running?
+int bflushing(void) {
+    return flusher.on;
+}
+
+// Ask the flusher to write back every dirty buffer soon, without
+// waiting for it. tfs_close calls this for files it wrote.
+void bkick(void) {
+    pthread_mutex_lock(&bcachelock);
+    if (flusher.on) {
+        flusher.all = 1;
+        pthread_cond_signal(&flusher.cond);
+    }
+    pthread_mutex_unlock(&bcachelock);
+}
+
+static void bflusherstop(void) {
+    if (!flusher.on)
+        return;
+    pthread_mutex_lock(&bcachelock);
+    flusher.stop = 1;
+    pthread_cond_signal(&flusher.cond);
+    pthread_mutex_unlock(&bcachelock);
+    pthread_join(flusher.thread, 0);
+    pthread_mutex_lock(&bcachelock);
+    flusher.on = 0;
+    pthread_mutex_unlock(&bcachelock);
+}
+
+// Write back dirty buffers and make the image durable on disk.
+void bsync(void) {
+    bflush();
+    if (fsmap) {
+        if (msync(fsmap, fsmapsize, MS_SYNC) < 0)
+            panic("bsync msync fail");
+    } else if (fsync(fs) < 0)
+        panic("bsync fsync fail");
+}
+
+// Copy out the cache hit/miss/eviction counters.
+void bstat(struct bcachestat *st) {
+    pthread_mutex_lock(&bcachelock);
+    *st = bcache.stat;
+    pthread_mutex_unlock(&bcachelock);
+}
+
 //
 // When calling this for FileLab, call as follows.
-// createfs("namechoice", NBLOCKS, NBLOCKS-8, 32);
+// createfs("namechoice", NBLOCKS, NBLOCKS-8, 32, 0);
 //  namechoice must be <= 12
-//  NBLOCKS is total 512 byte blocks allocated to file system
-//  Blocks 0 - 8 are allocated as sb, bitmaps, and inodes - see fs.h
-//  NBLOCKS-8 are allocated as data blocks
-int createfs(char *name, uint blks, uint dblks, uint inds) {
+//  NBLOCKS is total BSIZE byte blocks allocated to file system;
+//  call setbsize first for blocks bigger than 512 bytes
+//  Blocks 0 - 3 are allocated as sb and bitmaps, then the
+//  NIBLOCKS(32) = 4 blocks of inodes - see fs.h
+//  NBLOCKS-8 are allocated as data blocks, which must fit after the
+//  inodes; for n inodes pass NBLOCKS - INODESTART - NIBLOCKS(n).
+//  flags are SB_* format options, e.g. SB_DINDIRECT for large files
+//  SB_LOG puts LOGBLOCKS of log after the inodes; subtract them too.
+//  Images of more than BPB blocks keep their NBMAP(blks) data bitmap
+//  blocks after the inodes and log instead of in block 3; subtract
+//  those as well.
+int createfs(char *name, uint blks, uint dblks, uint inds, uint flags) {
+    uint nlog = (flags & SB_LOG) ? LOGBLOCKS : 0;
+    uint nbmap = NBMAP(blks) > 1 ? NBMAP(blks) : 0;
+    if (inds == 0 || inds > BPB)
+        panic("createfs: inode bitmap is one block");
+    if (inds > 0xffff)
+        panic("createfs: a dirent holds 16 bit inode numbers");
+    if (INODESTART + NIBLOCKS(inds) + nlog + nbmap + dblks > blks)
+        panic("createfs: inodes, log, bitmaps and data blocks do not fit");
     fs = open(name, O_CREAT | O_WRONLY | O_RDONLY | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fs < 0)
         panic("createfs open fail");
@@ -65,7 +953,7 @@ int createfs(char *name, uint blks, uint dblks, uint inds) {
         panic("createfs write fail");
     memset(b, 0, BSIZE);
     for (int i = 1; i < blks; i++) {
-        if (i > 7) // write block number on data blocks
+        if (i >= blks - dblks) // write block number on data blocks
             b[0] = i;
         int sz = write(fs, b, BSIZE);
         if (sz < 0)
@@ -76,52 +964,204 @@ int createfs(char *name, uint blks, uint dblks, uint inds) {
     sb.size = blks;
     sb.nblocks = dblks;
     sb.ninodes = inds;
-    sb.nlog = 0;
+    sb.nlog = nlog;
+    sb.flags = flags | SB_IBITMAP | SB_BGROUP | SB_UNWRITTEN;
+    sb.logstart = INODESTART + NIBLOCKS(inds);
+    sb.bsize = BSIZE;
+    sb.bmapstart = nbmap ? sb.logstart + nlog : 3;
     memset(sb.name, 0, 12);
     strcpy(sb.name, name); 
+    memset(b, 0, BSIZE);
     memcpy(b, &sb, sizeof(struct superblock));
-    if (bwrite(1, (char *)b) < 0)
-        panic("createfs bwrite fail");
+    if (lseek(fs, BSIZE, SEEK_SET) < 0 || write(fs, b, BSIZE) < 0)
+        panic("createfs write fail");
+    // inode bitmap: inode 0 is never used
+    memset(b, 0, BSIZE);
+    b[0] = 1;
+    if (write(fs, b, BSIZE) < 0)
+        panic("createfs write fail");
     close(fs);
     return 0;
 
 }
 
+// Set the block size, a power of two from MINBSIZE to MAXBSIZE, for
+// the next createfs. openfs sets it to the size of the image it opens.
+void setbsize(uint size) {
+    uint s;
+
+    for (s = 0; s < 31 && (1u << s) < size; s++)
+        ;
+    if ((1u << s) != size || size < MINBSIZE || size > MAXBSIZE)
+        panic("setbsize: not a power of two from MINBSIZE to MAXBSIZE");
+    bshift = s;
+}
+
+// Find the block size of the image open on fs. The super block is
+// block 1, so try each size until the super block there records it.
+// Images older than sb.bsize have 512 byte blocks.
+static void probebsize(void) {
+    struct superblock s;
+    uint size;
+
+    for (size = MINBSIZE; size <= MAXBSIZE; size *= 2) {
+        if (pread(fs, &s, sizeof(s), size) != sizeof(s))
+            break;
+        if (s.bsize == size || (size == MINBSIZE && s.bsize == 0 && s.size != 0)) {
+            setbsize(size);
+            return;
+        }
+    }
+    setbsize(MINBSIZE);  // not a tinyfs image; readfsinfo will say so
+}
+
 int openfs(char *name) {
+    struct stat st;
+
     fs = open(name, O_RDWR, S_IRUSR | S_IWUSR);
     if (fs < 0)
         panic("openfs open fail");
+    probebsize();
+    if (bcache.nbuf == 0)
+        binit(NBUF);
+    else if (bcache.bsize != BSIZE)
+        binit(bcache.nbuf);
+    if (fstat(fs, &st) < 0)
+        panic("openfs fstat fail");
+    bcache.nsector = st.st_size / BSIZE;
+    bcache.fresh = calloc(bcache.nsector/32 + 1, sizeof(uint));
+    if (bcache.fresh == 0)
+        panic("openfs: out of memory");
+    return 0;
+}
+
+// Open the image and map all of it into memory. bread and bwrite then
+// work on the mapped pages; bsync or closefs msync them to disk.
+int openfs_mmap(char *name) {
+    struct stat st;
+
+    openfs(name);
+    if (fstat(fs, &st) < 0)
+        panic("openfs_mmap fstat fail");
+    fsmapsize = st.st_size;
+    fsmap = mmap(0, fsmapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fs, 0);
+    if (fsmap == MAP_FAILED)
+        panic("openfs_mmap mmap fail");
     return 0;
 }
 
+// Write back dirty buffers and drop the cache.
+// The counters survive so they can be reported after closefs.
 int closefs() {
+    struct bcachestat st;
+    bflusherstop();
+    bflush();
+    bioqueuestop();
+    if (fsmap) {
+        if (msync(fsmap, fsmapsize, MS_SYNC) < 0)
+            panic("closefs msync fail");
+        munmap(fsmap, fsmapsize);
+        fsmap = 0;
+    }
+    st = bcache.stat;
+    free(bcache.buf);
+    free(bcache.mem);
+    free(bcache.fresh);
+    memset(&bcache, 0, sizeof(bcache));
+    bcache.stat = st;
     close(fs);
     return 0;
 }
 
-int balloc();
-void bfree(uint);
+// print_bstat shows how well the buffer and name caches are doing
+void print_bstat() {
+    struct bcachestat st;
+    struct dcachestat dst;
+    bstat(&st);
+    dcstat(&dst);
+    printf("bcache: hits %d, misses %d, evictions %d, writebacks %d\n",
+           st.hits, st.misses, st.evictions, st.writebacks);
+    printf("bcache: disk reads %d, disk writes %d, zero fills %d, readaheads %d\n",
+           st.diskreads, st.diskwrites, st.zerofills, st.readaheads);
+    printf("dcache: hits %d, negative hits %d, misses %d\n",
+           dst.hits, dst.neghits, dst.misses);
+}
+
+// A checksum of every byte of the image file.
+static uint imagesum(void) {
+    char buf[8192];
+    uint sum = 0;
+    ssize_t n;
+    int f = open(FSNAME, O_RDONLY);
+
+    if (f < 0)
+        panic("imagesum: open");
+    while ((n = read(f, buf, sizeof(buf))) > 0)
+        for (ssize_t i = 0; i < n; i++)
+            sum = sum * 31 + (uchar)buf[i];
+    close(f);
+    return sum;
+}
+
 struct inode *iget(uint);
 void print_inodes();
 int main(int argc, char *argv[]) {
 
-    unsigned char b[BSIZE];
+    unsigned char b[MAXBSIZE];  // BSIZE is not known until openfs
     memset(b, 0, BSIZE);
+    // -m opens the file system with openfs_mmap
+    // -d creates it with double indirect blocks, -e with extents
+    // -i n creates it with n inodes, -l with a write-ahead log
+    // -f writes back in the background with bflusher
+    // -a does disk I/O on NIOTHREAD threads with bioqueue
+    // -b n creates it with n byte blocks
+    // -D delays block allocation until files are closed, see fsdelalloc
+    int opt, mflag = 0, fflag = 0, aflag = 0, Dflag = 0;
+    uint flags = 0, ninodes = 32;
+    while ((opt = getopt(argc, argv, "madefli:Db:")) != -1) {
+        if (opt == 'm')
+            mflag = 1;
+        else if (opt == 'b')
+            setbsize(atoi(optarg));
+        else if (opt == 'a')
+            aflag = 1;
+        else if (opt == 'f')
+            fflag = 1;
+        else if (opt == 'D')
+            Dflag = 1;
+        else if (opt == 'i')
+            ninodes = atoi(optarg);
+        else if (opt == 'd')
+            flags |= SB_DINDIRECT;
+        else if (opt == 'e')
+            flags |= SB_EXTENT;
+        else if (opt == 'l')
+            flags |= SB_LOG;
+        else
+            exit(1);
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
     if (argc < 2) {
-        printf("must enter bio with create, write, read\n");
+        printf("must enter bio with create, write, read, fallocate\n");
         exit(1);
     }
     int s;
     if (strcmp(argv[1], "create") == 0) { // create fs file
         printf("create fs file.\n");
-        createfs(FSNAME, NBLOCKS, NBLOCKS-8, 32);
+        createfs(FSNAME, NBLOCKS, NBLOCKS - INODESTART - NIBLOCKS(ninodes) -
+                 ((flags & SB_LOG) ? LOGBLOCKS : 0), ninodes, flags);
         openfs(FSNAME);
         readfsinfo();
         // allocate Root Directory ("/")
-        struct inode *ip = ialloc(T_DIR);
-        ip->inum = 1;
-        ip->ref = 0xab;
+        begin_op();
+        struct inode *ip = ialloc(T_DIR, 0);
+        ilock(ip);
+        ip->nlink = 1;
+        iupdate(ip);
         printf("inode num: %d, type: %d\n", ip->inum, ip->type);
+        iunlockput(ip);
+        end_op();
         writefsinfo();
         closefs();
         /*
@@ -141,13 +1181,22 @@ int main(int argc, char *argv[]) {
         printf("manipulate fs file with writes.\n");
 
         // Open TFS and establish curr_proc so we can do application code
-        // curr_proc is a macro defined in proc.h
+        // curr_proc is thread-local, declared in proc.h
         curr_proc = malloc(sizeof(struct proc));
         strcpy(curr_proc->name, "Gusty");
-        openfs(FSNAME);
+        if (mflag)
+            openfs_mmap(FSNAME);
+        else
+            openfs(FSNAME);
+        if (aflag)
+            bioqueue(NIOTHREAD);
+        if (fflag)
+            bflusher(DIRTYAGE, DIRTYPCT);
         printf("fs : %d\n", fs);
         memset(b, 0, BSIZE);
         readfsinfo();
+        if (Dflag)
+            fsdelalloc();
         //struct inode *ip = ialloc(T_DIR);
         //ip->inum = 1;
         //ip->ref = 0xab;
@@ -202,8 +1251,9 @@ int main(int argc, char *argv[]) {
         tfs_close(fd5);
         
         // Write file info back to TDD and close TFS
-        writefsinfo();
+        tfs_sync();
         closefs();
+        print_bstat();
         //printf("size of inodes B : %lu\n", sizeof(struct inode));
         //printf("Inodes per block (IP)B : %lu\n", IPB);
         //printf("Block containing inode I - IBLOCK(30) : %lu\n", IBLOCK(30));
@@ -216,11 +1266,16 @@ int main(int argc, char *argv[]) {
         //printf("sizeof(time_t): %lu, time: %lx, %x\n",sizeof(time_t), seconds, ui);
     } else if (strcmp(argv[1], "read") == 0) {
         printf("manipulate fs file with reads.\n");
+        // Reading must leave the image as it was, log or not.
+        uint sum = imagesum();
         // Open TFS and establish curr_proc so we can do application code
-        // curr_proc is a macro defined in proc.h
+        // curr_proc is thread-local, declared in proc.h
         curr_proc = malloc(sizeof(struct proc));
         strcpy(curr_proc->name, "Gusty");
-        openfs(FSNAME);
+        if (mflag)
+            openfs_mmap(FSNAME);
+        else
+            openfs(FSNAME);
         printf("fs : %d\n", fs);
         memset(b, 0, BSIZE);
         readfsinfo();
@@ -252,9 +1307,79 @@ int main(int argc, char *argv[]) {
         // Write file info back to TDD and close TFS
         writefsinfo();
         closefs();
+        print_bstat();
+        if (imagesum() != sum) {
+            printf("read: the image changed\n");
+            exit(1);
+        }
+
+    } else if (strcmp(argv[1], "fallocate") == 0) {
+        // Reserve 100 blocks a file until the image runs out of space
+        // (ninodes is the -i it was created with). The last
+        // tfs_fallocate must return -1; after a remount the full files
+        // read as zeros, the short one is empty, and unlinking them
+        // gives every block back.
+        printf("fallocate past the free space.\n");
+        curr_proc = calloc(1, sizeof(struct proc));
+        strcpy(curr_proc->name, "Gusty");
+        int len = 100 * BSIZE, n, k, i, fd;
+        char name[DIRSIZ], *buf = malloc(len + 1);
+        for (int pass = 0; pass < 3; pass++) {
+            if (mflag)
+                openfs_mmap(FSNAME);
+            else
+                openfs(FSNAME);
+            readfsinfo();
+            curr_proc->cwd = iget(ROOTINO);
+            if (pass == 0) {
+                for (n = 0; n < (int)ninodes - 1; n++) {
+                    sprintf(name, "F%d", n);
+                    fd = tfs_open(name, TO_CREATE | TO_RDWR, 0);
+                    s = tfs_fallocate(fd, 0, len, 0);
+                    tfs_close(fd);
+                    if (s < 0)
+                        break;
+                }
+                if (n == (int)ninodes - 1) {
+                    printf("fallocate: never ran out of space\n");
+                    exit(1);
+                }
+                printf("fallocate: %d files of %d bytes, then -1\n", n, len);
+            } else if (pass == 1) {
+                for (k = 0; k <= n; k++) {
+                    sprintf(name, "F%d", k);
+                    fd = tfs_open(name, TO_RDONLY, 0);
+                    s = tfs_read(fd, buf, len + 1);
+                    tfs_close(fd);
+                    for (i = 0; i < s && buf[i] == 0; i++)
+                        ;
+                    if (s != (k < n ? len : 0) || i < s) {
+                        printf("fallocate: F%d reads back wrong\n", k);
+                        exit(1);
+                    }
+                    tfs_unlink(name);
+                }
+            } else {
+                for (k = 0; k < n; k++) {
+                    sprintf(name, "F%d", k);
+                    fd = tfs_open(name, TO_CREATE | TO_RDWR, 0);
+                    s = tfs_fallocate(fd, 0, len, 0);
+                    tfs_close(fd);
+                    tfs_unlink(name);
+                    if (s < 0) {
+                        printf("fallocate: blocks lost after unlink\n");
+                        exit(1);
+                    }
+                }
+                printf("fallocate ok\n");
+            }
+            writefsinfo();
+            closefs();
+        }
+        free(buf);
 
     } else {
-        printf("must enter bio with create, write, read\n");
+        printf("must enter bio with create, write, read, fallocate\n");
         exit(1);
     }
     return 0;
@@ -4,10 +4,27 @@ struct buf {
   uint sector;
   struct buf *prev; // LRU cache list
   struct buf *next;
+  struct buf *hnext; // hash chain
   struct buf *qnext; // disk queue
-  uchar data[512];
+  uchar *data;       // BSIZE bytes; points into the image when mapped
+  uint dirtied;      // when B_DIRTY was set, in ms - see bflusher
+  void (*iodone)(struct buf*);  // called when queued I/O finishes, or 0
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_LOG   0x8  // in the running log transaction; pinned in the cache
+#define B_QUEUED 0x10 // on the disk queue or being moved by an I/O thread
+#define B_QWRITE 0x20 // the queued request is a write
 
+// Buffer cache counters - see bstat in bio.c
+struct bcachestat {
+  uint hits;       // bget found the sector cached
+  uint misses;     // bget had to recycle a buffer
+  uint evictions;  // a cached sector was recycled
+  uint writebacks; // dirty buffers written to disk
+  uint diskreads;  // read system calls (one per run of blocks)
+  uint diskwrites; // write system calls (one per run of blocks)
+  uint zerofills;  // reads skipped because the block was fresh
+  uint readaheads; // blocks queued or hinted for readahead by breadahead
+};
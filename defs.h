@@ -1,4 +1,8 @@
+struct buf;
+struct bcachestat;
+struct dcachestat;
 struct context;
+struct extent;
 struct file;
 struct inode;
 struct proc;
@@ -9,27 +13,72 @@ void OkLoop(void);
 void NotOkLoop(void);
 
 // bio.c
-void            binit(void);
-int             bread(uint, char*);
-int             bwrite(uint, char*);
+void            binit(uint);
+void            setbsize(uint);
+void            bioqueue(uint);
+struct buf*     bget(uint);
+struct buf*     bgetdelay(void);
+void            brelsedelay(struct buf*);
+struct buf*     bread(uint);
+int             breadv(uint, int, struct buf**);
+void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bwritedirect(uint, int, char*);
+void            brelse(struct buf*);
+void            bflush(void);
+void            bflusher(uint, uint);
+int             bflushing(void);
+void            bkick(void);
+void            bfresh(uint);
+void            bunfresh(uint);
+void            breadahead(uint, int);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+void            bsync(void);
+void            bstat(struct bcachestat*);
 
 // fs.c
+uint            balloc(void);
+uint            ballocrun(uint, uint, uint*);
+int             balloc_n(uint, uint, struct extent*, int);
+void            bfree(uint);
 void		readfsinfo();
 void		writefsinfo();
+void            logfsinfo(void);
 void            readsb(struct superblock *sb);
+int             fsjournaled(void);
+void            fsdelalloc(void);
+void            idelalloc(struct inode*);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(short);
+void            dirunlink(struct inode*, uint);
+void            dcstat(struct dcachestat*);
+struct inode*   ialloc(short, uint);
 struct inode*   idup(struct inode*);
 void            iinit(void);
+void            ilock(struct inode*);
 void            iput(struct inode*);
+void            iunlock(struct inode*);
+void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct tfs_stat*);
 int             writei(struct inode*, char*, uint, uint);
+int             ifallocate(struct inode*, uint, uint, int);
+int             izero(struct inode*, uint);
+
+// log.c
+void            initlog(void);
+void            log_write(struct buf*);
+void            begin_op(void);
+void            end_op(void);
+uint            log_groups(void);
+void            log_group(void);
+void            log_checkpoint(void);
 
 // file.c
 struct file*    filealloc(void);
@@ -38,6 +87,7 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct tfs_stat*);
+int             fileallocate(struct file*, uint, uint, int);
 int             filewrite(struct file*, char*, int n);
 
 // console.c
@@ -2,3 +2,5 @@
 #define TO_WRONLY  0x001
 #define TO_RDWR    0x002
 #define TO_CREATE  0x200
+
+#define TF_KEEPSIZE 0x1  // tfs_fallocate leaves the file size alone
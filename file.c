@@ -1,44 +1,54 @@
 //
 // File descriptors
-// Removed locks - ftable lock and locking inodes
 // Removed log.c stuff begin_trans, etc.
 // See Xv6 source for missing code
 //
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "fs.h"
 #include "file.h"
+#include "fcntl.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 struct {
+  pthread_mutex_t lock;
   struct file file[NFILE];
-} ftable;
+} ftable = { PTHREAD_MUTEX_INITIALIZER };
 
 void fileinit(void) {
-  memset(&ftable, 0, sizeof(ftable));
+  memset(ftable.file, 0, sizeof(ftable.file));
 }
 
 // Allocate a file structure.
 struct file* filealloc(void) {
   struct file *f;
 
+  pthread_mutex_lock(&ftable.lock);
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
+      pthread_mutex_unlock(&ftable.lock);
       return f;
     }
   }
+  pthread_mutex_unlock(&ftable.lock);
   return 0;
 }
 
 // Increment ref count for file f.
 struct file* filedup(struct file *f) {
+  pthread_mutex_lock(&ftable.lock);
   if(f->ref < 1)
     panic("filedup");
   f->ref++;
+  pthread_mutex_unlock(&ftable.lock);
   return f;
 }
 
@@ -46,39 +56,71 @@ struct file* filedup(struct file *f) {
 void fileclose(struct file *f) {
   struct file ff;
 
+  pthread_mutex_lock(&ftable.lock);
   if(f->ref < 1)
     panic("fileclose");
   if(--f->ref > 0){
+    pthread_mutex_unlock(&ftable.lock);
     return;
   }
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  pthread_mutex_unlock(&ftable.lock);
   
   if(ff.type == FD_INODE){
+    if(ff.writable){  // delayed blocks get disk blocks now
+      ilock(ff.ip);
+      idelalloc(ff.ip);
+      iunlock(ff.ip);
+    }
+    begin_op();
     iput(ff.ip);
+    end_op();
+    if(ff.writable)
+      bkick();  // start writing back what was written
   }
 }
 
 // Get metadata about file f.
 int filestat(struct file *f, struct tfs_stat *st) {
   if(f->type == FD_INODE){
+    ilock(f->ip);
     stati(f->ip, st);
+    iunlock(f->ip);
     return 0;
   }
   return -1;
 }
 
 // Read from file f.
+// A read that starts where the last one ended continues a sequential
+// run. Once a run has read half its readahead window, the next window
+// is hinted with ireadahead, and the window doubles up to RAMAX blocks.
+// A read anywhere else ends the run and its readahead.
 int fileread(struct file *f, char *addr, int n) {
   int r;
+  uint bn;
 
   if(f->readable == 0)
     return -1;
   if(f->type == FD_INODE){
 //cprintf("inside fileread\n");
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
+    ilock(f->ip);
+    if(f->off != f->raoff)
+      f->rawin = f->raend = 0;
+    bn = f->off / BSIZE;
+    if((r = readi(f->ip, addr, f->off, n)) > 0){
       f->off += r;
+      if(f->off - r == f->raoff && bn + f->rawin/2 >= f->raend){
+        f->rawin = f->rawin ? min(2*f->rawin, RAMAX) : RAMIN;
+        bn = max(f->off / BSIZE, f->raend);
+        f->raend = f->off / BSIZE + f->rawin;
+        ireadahead(f->ip, bn, f->raend - bn);
+      }
+      f->raoff = f->off;
+    }
+    iunlock(f->ip);
 //cprintf("inside fileread: after readi rv=%x\n", r);
     return r;
   }
@@ -89,37 +131,64 @@ int fileread(struct file *f, char *addr, int n) {
 //PAGEBREAK!
 // Write to file f.
 int filewrite(struct file *f, char *addr, int n) {
-  int r;
+  int r = 0, z;
 
   if(f->writable == 0)
     return -1;
 //cprintf("inside filewrite\n");
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
+    // With a journal, write a few blocks at a time to avoid
+    // exceeding the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    // Without one, writei plans the whole write in one call.
+    int max = fsjournaled() ? ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE : n;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
+      begin_op();
+      ilock(f->ip);
+      // Unwritten blocks the write would skip are zeroed first, in
+      // transactions of their own - see izero.
+      if((z = izero(f->ip, f->off)) == 0 && (r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
-
-      if(r < 0)
+      iunlock(f->ip);
+      end_op();
+
+      if(z > 0)
+        continue;
+      // A short write goes on in the next transaction, which with a log
+      // may have bitmap blocks to allocate from that this one had not.
+      if(r <= 0)  // an error, or out of extents or disk space
         break;
-      if(r != n1)
-        panic("short filewrite");
       i += r;
     }
-    return i == n ? n : -1;
+    return i > 0 || n == 0 ? i : -1;
   }
   panic("filewrite");
   return -1;
 }
 
+// Allocate disk blocks for bytes [off, off+len) of file f, growing it
+// to off+len unless flags has TF_KEEPSIZE.
+int fileallocate(struct file *f, uint off, uint len, int flags) {
+  int r;
+
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  // With a journal, ifallocate allocates NPLAN blocks per call, from
+  // the file's first block without one, so the indirect blocks and
+  // bitmap blocks it changes fit in the log; give each its own
+  // transaction.
+  do {
+    begin_op();
+    ilock(f->ip);
+    r = ifallocate(f->ip, off, len, flags & TF_KEEPSIZE);
+    iunlock(f->ip);
+    end_op();
+  } while(r > 0);
+  return r;
+}
@@ -6,9 +6,39 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint raoff;  // where the next read continues a sequential run
+  uint rawin;  // readahead window in blocks, 0 if reads are random
+  uint raend;  // first block past those hinted for readahead
 };
 
 
+// Name cache counters - see dcstat in fs.c
+struct dcachestat {
+  uint hits;     // found the inode for a name
+  uint neghits;  // found that a name does not exist
+  uint misses;   // had to search the directory
+};
+
+// in-memory copy of an inode
+struct inode {
+  uint inum;     // inode number
+  int ref;       // reference count
+  int flags;     // I_BUSY, I_VALID
+  struct inode *hnext;  // icache hash chain
+
+  uint type;     // copy of disk inode
+  uint nlink;
+  uint size;
+  uint ctime;
+  uint mtime;
+  uint blocks[NDIRECT+1];
+  uint unwritten;  // see iunwritten
+
+  uint goal;     // next data block to allocate, 0 if none yet - see igoal
+  struct buf *delay;  // blocks with no disk block yet - see idelwrite
+  uint ndelay;
+};
+
 #define I_BUSY 0x1
 #define I_VALID 0x2
 
@@ -1,7 +1,7 @@
 /*
  * File system implementation has five layers:
  *   + Blocks: allocator for raw disk blocks - see bio.c
- *   + Log: crash recovery for multi-step updates - NOT USED in tfs.
+ *   + Log: crash recovery for multi-step updates - see log.c, SB_LOG only.
  *   + Files: inode allocator, reading, writing, metadata - see fs.c and file.c.
  *   + Directories: inode with special contents (list of other inodes!)
  *   + Names: paths like /usr/rtm/xv6/fs.c for convenient naming.
@@ -11,8 +11,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "types.h"
 #include "defs.h"
 #include "param.h"
@@ -20,100 +22,449 @@
 #include "proc.h"
 #include "fs.h"
 #include "file.h"
+#include "buf.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void bload(void);
+static int bunmark(uint);
+static void idelallocall(void);
+static void idelfree(struct inode*);
+static uint imapped(struct inode*);
+static uint blookup(struct inode*, uint);
+static void diridxdrop(uint);
+static void diridxinit(void);
+static void dcenter(uint, char*, uint);
+static void dcpurge(uint);
+static void dcinit(void);
+static void irebuild(void);
+static void iclearunwritten(void);
 
 /* 
- * The Xv6 file system requires locks on various data structures.
- * tinyfs does not require locks
+ * Locking, as in Xv6, so several threads can use one file system.
+ * Each inode has a sleep lock (I_BUSY, see ilock) that guards its
+ * contents; readi, writei, itrunc, stati, iupdate and the directory
+ * functions need it held. A directory's lock also guards its index.
+ * Mutexes guard the shared tables:
+ *   icachelock  - inode cache entries, ref and flags
+ *   bitmaplock  - both bitmaps, group counts, hints and fsdirty
+ *   diridxlock  - which directory each index slot holds
+ *   dclock      - the name cache
+ * and bio.c has bcachelock. Locks are taken in the order
+ * inode, bitmaplock, bcachelock; icachelock, diridxlock and dclock are
+ * never held while taking another lock.
+ * mount (readfsinfo) and unmount (writefsinfo) are single threaded.
  */
+static pthread_mutex_t icachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t icachecond = PTHREAD_COND_INITIALIZER;  // ilock waits
+static pthread_mutex_t bitmaplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t diridxlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diridxcond = PTHREAD_COND_INITIALIZER;  // diridxget waits
+static pthread_mutex_t dclock = PTHREAD_MUTEX_INITIALIZER;
 
-char buf[BSIZE];
 struct superblock sb;
-uint inodebitmap[BSIZE/4]; // block 2 is reserved for inode bitmap
-                           // currently, inode.type == 0 is a free inode
-uint databitmap[BSIZE/4];  // block 3 is data block bitmap
-struct inode inodes[32];   // 32 inodes on blocks 4 through 7
+uint inodebitmap[MAXBSIZE/4]; // block 2 is inode bitmap
+uint *databitmap;              // data block bitmap, ngroup blocks of it
 
-// Read the super block, bitmaps, and inodes.
+// Allocation groups - see balloc
+static uint ngroup;    // one for each data bitmap block
+static uint *gfree;    // free data blocks in each group
+static uchar *gdirty;  // groups whose bitmap block writefsinfo must write
+static uint *bdeferred;  // frees waiting for the next transaction, see bfree
+static uint ndeferred, maxdeferred;
+
+// Metadata blocks changed since writefsinfo last wrote them.
+// Inode blocks are not here: iupdate marks them dirty in the buffer cache.
+#define D_SB      0x1
+#define D_IBITMAP 0x2
+static uint fsdirty;
+
+// In-memory inode cache - see iget
+#define NIBUCKET 31
+struct {
+  struct inode inode[NINODE];
+  struct inode *hash[NIBUCKET];  // entries in use, hashed by inum
+  uint hand;                     // clock hand for reusing entries
+} icache;
+
+// Read the super block and bitmaps.
+// Inodes are read when ilock first needs them.
 void readfsinfo() {
-  int s = bread(1, buf);
-  memcpy(&sb, buf, sizeof(sb));
-  s = bread(2, buf);
-  memcpy(inodebitmap, buf, BSIZE);
-  s = bread(3, buf);
-  memcpy(databitmap, buf, BSIZE);
-  //int j = 0;
-  for (int i = 0; i < 4; i++) {
-    int s = bread(i+4, buf);
-    if (s < 0)
-      panic("bread fail");
-    for (int j = 0; j < 8; j++)
-        memcpy(&inodes[j+i*8], buf+(j*sizeof(struct inode)), sizeof(struct inode));
-  }
-  // copy link to ref - think about this
-  for (int i = 0; i < sb.ninodes; i++)
-    inodes[i].ref = inodes[i].nlink;
+  struct buf *b = bread(1);
+  memcpy(&sb, b->data, sizeof(sb));
+  brelse(b);
+  if (sb.flags & SB_LOG) {  // replay committed transactions first
+    initlog();
+    b = bread(1);
+    memcpy(&sb, b->data, sizeof(sb));
+    brelse(b);
+  }
+  b = bread(2);
+  memcpy(inodebitmap, b->data, BSIZE);
+  brelse(b);
+  if (sb.bsize == 0)
+    sb.bsize = MINBSIZE;
+  if (sb.bsize != BSIZE)
+    panic("readfsinfo: block size is not the one openfs found");
+  if (sb.ninodes == 0 || sb.ninodes > BPB)
+    panic("readfsinfo: bad inode count");
+  if (!(sb.flags & SB_BGROUP))
+    sb.bmapstart = 3;
+  bload();
+  fsdirty = 0;
+  if (!(sb.flags & SB_IBITMAP))
+    irebuild();
+  if (!(sb.flags & SB_UNWRITTEN))
+    iclearunwritten();
+  memset(&icache, 0, sizeof(icache));
+  diridxinit();
+  dcinit();
 }
 
 // print_inodes can be used for debugging
 void print_inodes() {
-  for (int k = 0; k < 32; k++)
-      printf("inodes[%d].ref, type, size, num, ctime: %x, %d, %d, %d, %x\n", k, inodes[k].ref, inodes[k].type, inodes[k].size, inodes[k].inum, inodes[k].ctime);
+  for (int k = 0; k < sb.ninodes; k++) {
+    struct buf *b = bread(IBLOCK(k));
+    struct dinode *dip = (struct dinode*)b->data + k%IPB;
+    printf("inodes[%d].type, size, num, ctime: %d, %d, %d, %x\n", k, dip->type, dip->size, dip->inum, dip->ctime);
+    brelse(b);
+  }
 }
 
-// Write the super block, bitmaps, and inodes.
+// Write the super block and bitmaps that changed since they were
+// last written; a file system that was only read writes nothing.
+// The blocks are marked dirty in the buffer cache and
+// reach the disk when closefs or tfs_sync flushes the cache.
+// Inodes are already there: iupdate writes each one as it changes.
+// With a log, the writes are committed as a transaction of their own.
 void writefsinfo() {
-  memset(buf, 0, BSIZE);
-  memcpy(buf, &sb, sizeof(sb));
-  int s = bwrite(1, buf);
-  memset(buf, 0, BSIZE);
-  memcpy(buf, inodebitmap, BSIZE);
-  s = bwrite(2, buf);
-  memset(buf, 0, BSIZE);
-  memcpy(buf, databitmap, BSIZE);
-  s = bwrite(3, buf);
-  //int j = 0;
-  for (int i = 0; i < 4; i++) {
-    memset(buf, 0, BSIZE);
-    for (int j = 0; j < 8; j++) {
-      memcpy(buf+(j*sizeof(struct inode)), &inodes[j+i*8], sizeof(struct inode));
-    }
-    int s = bwrite(i+4, buf);
-    if (s < 0)
-      panic("bwrite fail");
+  int more;
+
+  idelallocall();
+  if (fsjournaled()) {
+    do {  // each commit takes some of the deferred frees
+      begin_op();
+      end_op();
+      pthread_mutex_lock(&bitmaplock);
+      more = ndeferred > 0;
+      pthread_mutex_unlock(&bitmaplock);
+    } while (more);
+    log_checkpoint();
+  } else
+    logfsinfo();
+}
+
+// Log the changed super block and bitmaps. end_op calls this just
+// before each commit, so they go to disk with the blocks they describe.
+// Each block is overwritten whole, so bget skips the disk read.
+void logfsinfo() {
+  struct buf *b;
+  uint i, j;
+  pthread_mutex_lock(&bitmaplock);
+  for (i = j = 0; i < ndeferred; i++)
+    if (!bunmark(bdeferred[i]))
+      bdeferred[j++] = bdeferred[i];
+  ndeferred = j;
+  if (fsdirty & D_SB) {
+    b = bget(1);
+    memset(b->data, 0, BSIZE);
+    memcpy(b->data, &sb, sizeof(sb));
+    log_write(b);
+    brelse(b);
+  }
+  if (fsdirty & D_IBITMAP) {
+    b = bget(2);
+    memcpy(b->data, inodebitmap, BSIZE);
+    log_write(b);
+    brelse(b);
+  }
+  for (uint g = 0; g < ngroup; g++) {
+    if (!gdirty[g])
+      continue;
+    b = bget(BBLOCK(g*BPB, sb));
+    memcpy(b->data, (uchar*)databitmap + g*BSIZE, BSIZE);
+    log_write(b);
+    brelse(b);
+    gdirty[g] = 0;
   }
+  fsdirty = 0;
+  pthread_mutex_unlock(&bitmaplock);
 }
 
 /*
  * Blocks. 
- * Allocate a zeroed disk block.
- * See Xv6 balloc for how to use superblock to search for free blocks.
- * Our simple approach uses Block 3 for data block bitmap
- * First data block is block 8. Note start loop index.
+ * Allocate zeroed disk blocks.
+ * The data block bitmap has a bit for each block of the image, kept
+ * in memory. With SB_BGROUP it is NBMAP(sb.size) blocks from
+ * sb.bmapstart; older images have only block 3, for the first BPB.
+ * The last sb.nblocks blocks of the image are data blocks.
+ * Each bitmap block covers an allocation group of BPB blocks, and
+ * gfree counts the free blocks of each group, so searches skip full
+ * groups without scanning their bits. Within a group the bitmap is
+ * searched a word at a time, skipping full words and using ctz to
+ * find the free bit, starting from a next-fit hint just past the last
+ * allocation so allocation does not rescan full space. Only the
+ * bitmap blocks of groups that changed are written back. With a log
+ * they join the commit, so an op may change only LOGGROUPS of them
+ * and allocation passes over the groups it may not change.
  */
-uint balloc() {
-  uint m;
-  for(int bi = 8; bi < 1024; bi++) { // 1024 blocks for file data
-    m = 1 << (bi % 32);
-    if((databitmap[bi/32] & m) == 0){  // Is block free?
-      databitmap[bi/32] |= m;  // Mark block in use.
-      memset(buf, 0, BSIZE);
-      bwrite(bi, buf);
+static uint bhint;  // next-fit: where the next search starts
+
+static int bused(uint bi) {
+  return databitmap[bi/32] & (1u << (bi % 32));
+}
+
+// First and one past last data block.
+static uint blo() {
+  return sb.size - sb.nblocks;
+}
+
+static uint bhi() {
+  return (sb.flags & SB_BGROUP) ? sb.size : min(sb.size, BPB);
+}
+
+// Note that group g's bitmap block changed. With a log, the commit
+// logs it, so the first change in a transaction counts against the
+// op's share of bitmap blocks (log_groups).
+static void bdirty(uint g) {
+  if(!gdirty[g]){
+    gdirty[g] = 1;
+    log_group();
+  }
+}
+
+// Number of blocks in use in [lo, hi).
+static uint bcount(uint lo, uint hi) {
+  uint n = 0;
+
+  for(; lo < hi && lo % 32; lo++)
+    n += bused(lo) != 0;
+  for(; lo + 32 <= hi; lo += 32)
+    n += __builtin_popcount(databitmap[lo/32]);
+  for(; lo < hi; lo++)
+    n += bused(lo) != 0;
+  return n;
+}
+
+// Read the data bitmap and count the free blocks of each group.
+static void bload(void) {
+  struct buf *b;
+  uint g, lo, hi;
+
+  ngroup = (sb.flags & SB_BGROUP) ? NBMAP(sb.size) : 1;
+  free(databitmap);
+  free(gfree);
+  free(gdirty);
+  databitmap = calloc(ngroup, BSIZE);
+  gfree = calloc(ngroup, sizeof(uint));
+  gdirty = calloc(ngroup, 1);
+  if(databitmap == 0 || gfree == 0 || gdirty == 0)
+    panic("readfsinfo: out of memory");
+  ndeferred = 0;
+  for(g = 0; g < ngroup; g++){
+    b = bread(BBLOCK(g*BPB, sb));
+    memcpy((uchar*)databitmap + g*BSIZE, b->data, BSIZE);
+    brelse(b);
+    lo = max(blo(), g*BPB);
+    hi = min(bhi(), (g+1)*BPB);
+    if(lo < hi)
+      gfree[g] = hi - lo - bcount(lo, hi);
+  }
+}
+
+// Return the first bit in [bi, hi) of bitmap map that equals used,
+// or hi if there is none. Used for the inode bitmap too.
+static uint bscan(uint *map, uint bi, uint hi, int used) {
+  uint w;
+
+  while(bi < hi){
+    w = used ? map[bi/32] : ~map[bi/32];
+    w &= ~0u << (bi % 32);  // ignore bits before bi
+    if(w)
+      return min((bi & ~31) + __builtin_ctz(w), hi);
+    bi = (bi & ~31) + 32;
+  }
+  return hi;
+}
+
+// The end of the free run from block bi, before hi: the first block
+// in use, or the start of a group the op may not change because its
+// share of bitmap blocks would run out.
+static uint bfreeend(uint bi, uint hi) {
+  uint end = bscan(databitmap, bi, hi, 1), left = log_groups();
+
+  for(uint g = bi/BPB; g*BPB < end; g++)
+    if(!gdirty[g] && left-- == 0)
+      return max(bi, g*BPB);
+  return end;
+}
+
+// Return the first free block in [bi, hi), or hi if there is none,
+// skipping the groups that have no free blocks or that the op may
+// not change.
+static uint bnextfree(uint bi, uint hi) {
+  uint g, end;
+
+  while(bi < hi){
+    g = bi / BPB;
+    end = min(hi, (g+1)*BPB);
+    if(gfree[g] > 0 && (gdirty[g] || log_groups() > 0) &&
+       (bi = bscan(databitmap, bi, end, 0)) < end)
       return bi;
+    bi = end;
+  }
+  return hi;
+}
+
+// Find free blocks for a run of want. Return the start of the first
+// free run, searching from block start around the data blocks, that is
+// at least want long, or failing that the longest free run.
+// Set *len to the run length (0 if the disk is full).
+static uint bfindrun(uint start, uint want, uint *len) {
+  uint lo = blo(), hi = bhi(), bi, end, best = 0, bestlen = 0;
+
+  if(start < lo || start >= hi)
+    start = lo;
+  for(int pass = 0; pass < 2; pass++){
+    // Search [start, hi), then [lo, start).
+    bi = pass == 0 ? start : lo;
+    uint stop = pass == 0 ? hi : start;
+    while((bi = bnextfree(bi, stop)) < stop){
+      end = bfreeend(bi, min(stop, bi + want));
+      if(end - bi >= want){
+        *len = want;
+        return bi;
+      }
+      if(end - bi > bestlen){
+        best = bi;
+        bestlen = end - bi;
+      }
+      bi = end;
     }
   }
-  panic("balloc: out of blocks");
-  return -1;
+  *len = bestlen;
+  return best;
+}
+
+// Mark block bi in use. bfresh makes it read as zeros
+// without a zeroing write.
+static void bclaim(uint bi) {
+  databitmap[bi/32] |= 1u << (bi % 32);
+  gfree[bi/BPB]--;
+  bdirty(bi/BPB);
+  bfresh(bi);
+}
+
+uint balloc() {
+  uint n;
+  return ballocrun(0, 1, &n);
+}
+
+// Claim the free blocks in a row from block bi, up to want of them.
+// Return how many; 0 if bi is in use or not a data block.
+// Caller holds bitmaplock.
+static uint bclaimrun(uint bi, uint want) {
+  uint n = 0;
+
+  if(bi >= blo() && bi < bhi() && !bused(bi))
+    n = bfreeend(bi, min(bhi(), bi + want)) - bi;
+  for(uint k = 0; k < n; k++)
+    bclaim(bi + k);
+  return n;
+}
+
+// Allocate a run of up to want zeroed blocks in a row.
+// The run starts at block goal if that block is free, so a caller can
+// grow a file's last run; otherwise it is the run bfindrun picks
+// searching from goal, or from the hint if goal is 0.
+// Return the first block and set *got to the length of the run,
+// which is 0 if the disk is full.
+static uint brun(uint goal, uint want, uint *got) {
+  uint bi = goal, n;
+
+  pthread_mutex_lock(&bitmaplock);
+  if((n = bclaimrun(goal, want)) == 0){
+    bi = bfindrun(goal ? goal : bhint, want, &n);
+    n = bclaimrun(bi, n);
+  }
+  if(n > 0 && goal == 0)
+    bhint = bi + n;
+  pthread_mutex_unlock(&bitmaplock);
+  *got = n;
+  return bi;
+}
+
+// Allocate up to want blocks in a row starting exactly at block bi,
+// for a run that can only grow in place. Return how many; 0 if bi is
+// not free.
+static uint bgrow(uint bi, uint want) {
+  uint n;
+
+  pthread_mutex_lock(&bitmaplock);
+  n = bclaimrun(bi, want);
+  pthread_mutex_unlock(&bitmaplock);
+  return n;
+}
+
+// brun that insists on at least one block.
+uint ballocrun(uint goal, uint want, uint *got) {
+  uint bi = brun(goal, want, got);
+  if(*got == 0)
+    panic("balloc: out of blocks");
+  return bi;
+}
+
+// Allocate count blocks as runs, filling in at most nrun entries of
+// runs. The first run starts at or after block goal (see brun), and
+// each run starts right after the previous one if it can.
+// Return the number of runs used; if they hold fewer than count
+// blocks, the disk or runs[] ran out.
+int balloc_n(uint goal, uint count, struct extent *runs, int nrun) {
+  int k;
+
+  for(k = 0; k < nrun && count > 0; k++){
+    runs[k].start = brun(goal, count, &runs[k].len);
+    if(runs[k].len == 0)
+      break;
+    count -= runs[k].len;
+    goal = runs[k].start + runs[k].len;
+  }
+  return k;
 }
 
 // Free a disk block.
+// Mark block bi free, unless the op has changed as many bitmap blocks
+// as it may (log_groups) and bi's is not one of the transaction's.
+// Caller holds bitmaplock.
+static int bunmark(uint bi) {
+  uint g = bi / BPB;
+
+  if(!gdirty[g] && log_groups() == 0)
+    return 0;
+  databitmap[bi/32] &= ~(1u << (bi % 32));
+  gfree[g]++;
+  bdirty(g);
+  return 1;
+}
+
+// Free a disk block. With a log, a free that does not fit in this
+// transaction's bitmap blocks stays allocated until logfsinfo can add
+// it to a later one; a crash before then leaks the block, nothing more.
 void bfree(uint bi) {
-  uint m = 1 << (bi % 32);
-  if((databitmap[bi/32] & m) == 0)
+  pthread_mutex_lock(&bitmaplock);
+  if(bused(bi) == 0)
     panic("freeing free block");
-  databitmap[bi/32] &= ~m;
+  if(!bunmark(bi)){
+    if(ndeferred == maxdeferred){
+      maxdeferred = maxdeferred ? 2*maxdeferred : 64;
+      if((bdeferred = realloc(bdeferred, maxdeferred*sizeof(uint))) == 0)
+        panic("bfree: out of memory");
+    }
+    bdeferred[ndeferred++] = bi;
+  }
+  pthread_mutex_unlock(&bitmaplock);
+  bunfresh(bi);
 }
 
 /*
@@ -128,62 +479,192 @@ void bfree(uint bi) {
  * the superblock. Each inode has a number, indicating its
  * position on the disk. We have one block for inodes
  *
- * tinyfs caches all inodes in memory. 
- * The cache is written back to disk on exit.
- * Since we have all inodes in memory, we do not have to free space 
- * and evict an inode to replace it with another.
+ * iget finds or makes an entry for an inode in the in-memory inode
+ * cache, which holds NINODE inodes hashed by inode number. ilock reads
+ * the inode from its disk block the first time it is locked.
+ * ip->ref counts the pointers to a cache entry; an entry whose ref
+ * drops to zero keeps its copy until a clock hand picks its slot for
+ * another inode. Code that changes an inode calls iupdate, which
+ * copies it into its disk block in the buffer cache, so only inode
+ * blocks that changed are written back.
+ *
+ * The inode bitmap marks the inodes in use. ialloc searches it a word
+ * at a time, like balloc does the data bitmap. The inodes are spread
+ * evenly over the allocation groups, and an inode's data is allocated
+ * in its own group (see igoal), so ialloc places a file in its parent
+ * directory's group and a new directory in the group with the most
+ * free blocks.
+ *
+ * As in Xv6, the usual sequence is:
+ *   ip = iget(inum) or namei(path)
+ *   ilock(ip)
+ *   ... examine and modify ip->xxx ...
+ *   iunlock(ip)
+ *   iput(ip)
  */
 struct inode* iget(uint inum);
-uint c_time = 0x30313241;
-time_t seconds;
-// Allocate a new inode with the given type
-// A free inode has a type of zero.
+
+// The allocation group of inode inum.
+static uint igroup(uint inum) {
+  return (u64)inum * ngroup / sb.ninodes;
+}
+
+// The first inode of group g.
+static uint ginode(uint g) {
+  return max(1, ((u64)g * sb.ninodes + ngroup - 1) / ngroup);
+}
+
+// Build the inode bitmap from the inode types, for images made
+// before the bitmap was kept. A free inode has a type of zero.
+static void irebuild(void) {
+  struct buf *bp;
+  struct dinode *dip;
+
+  memset(inodebitmap, 0, BSIZE);
+  inodebitmap[0] = 1;  // inode 0 is never used
+  for(uint inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(IBLOCK(inum));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0)
+      inodebitmap[inum/32] |= 1u << (inum % 32);
+    brelse(bp);
+  }
+  sb.flags |= SB_IBITMAP;
+  fsdirty |= D_SB | D_IBITMAP;
+}
+
+// Zero dinode.unwritten, for images made before it was kept, when the
+// field held other things. The inode blocks are on disk before the
+// super block says the field is in use.
+static void iclearunwritten(void) {
+  struct buf *bp;
+  struct dinode *dip;
+
+  for(uint ib = IBLOCK(0); ib <= IBLOCK(sb.ninodes-1); ib++){
+    bp = bread(ib);
+    for(dip = (struct dinode*)bp->data; dip < (struct dinode*)bp->data + IPB; dip++)
+      dip->unwritten = 0;
+    bwrite(bp);
+    brelse(bp);
+  }
+  bsync();
+  sb.flags |= SB_UNWRITTEN;
+  fsdirty |= D_SB;
+}
+
+// Allocate a new inode with the given type in directory parent,
+// or at the start of the disk if parent is 0.
 // type is T_FILE, T_DIR, T_DEV
-struct inode* ialloc(short type) {
-  for(int inum = 1; inum < sb.ninodes; inum++) {
-    if(inodes[inum].type == 0){  // a free inode
-      memset(&inodes[inum], 0, sizeof(struct inode));
-      inodes[inum].type = type;
-      inodes[inum].inum = inum;
-      time(&seconds);
-      memcpy(&c_time, &seconds, 4);
-      inodes[inum].ctime = c_time;
-      return &inodes[inum];
+// Returns an unlocked but allocated and referenced inode.
+struct inode* ialloc(short type, uint parent) {
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum, start, g;
+  time_t seconds;
+
+  pthread_mutex_lock(&bitmaplock);
+  g = parent ? igroup(parent) : 0;
+  if(type == T_DIR && parent)
+    for(uint i = 0; i < ngroup; i++)
+      if(gfree[i] > gfree[g])
+        g = i;
+  start = ginode(g);
+  // Search [start, ninodes), then [1, start).
+  if((inum = bscan(inodebitmap, start, sb.ninodes, 0)) == sb.ninodes)
+    if((inum = bscan(inodebitmap, 1, start, 0)) == start)
+      panic("ialloc: no inodes");
+  inodebitmap[inum/32] |= 1u << (inum % 32);
+  fsdirty |= D_IBITMAP;
+  pthread_mutex_unlock(&bitmaplock);
+
+  bp = bread(IBLOCK(inum));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  dip->inum = inum;
+  time(&seconds);
+  dip->ctime = (uint)seconds;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(inum);
+}
+
+// Copy a modified in-memory inode to disk.
+// Must be called after every change to an ip->xxx field
+// that lives on disk, with ip locked. The inode block is marked
+// dirty in the buffer cache and written back with the other dirty blocks.
+void iupdate(struct inode *ip) {
+  struct buf *bp;
+  struct dinode *dip;
+
+  bp = bread(IBLOCK(ip->inum));
+  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  dip->type = ip->type;
+  dip->nlink = ip->nlink;
+  // Delayed blocks are not on disk yet, so neither is the size they add.
+  dip->size = ip->delay ? min(ip->size, ip->delay->sector*BSIZE) : ip->size;
+  dip->inum = ip->inum;
+  dip->ctime = ip->ctime;
+  dip->mtime = ip->mtime;
+  memmove(dip->blocks, ip->blocks, sizeof(ip->blocks));
+  dip->unwritten = ip->unwritten;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Take ip out of its hash chain. Caller holds icachelock.
+static void ihashremove(struct inode *ip) {
+  struct inode **p;
+
+  for(p = &icache.hash[ip->inum % NIBUCKET]; *p; p = &(*p)->hnext)
+    if(*p == ip){
+      *p = ip->hnext;
+      break;
     }
-  }
-  panic("ialloc: no inodes");
-  return 0;
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
-// ROOTINO is inodes[1]
-// Do not use inodes[0]
-// Need to have a ip->ref > 0 on the disk GUSTY-TODO
+// Find the inode with number inum and return the in-memory copy.
+// Does not lock the inode and does not read it from disk.
+// ROOTINO is inode 1
+// Do not use inode 0
 struct inode* iget(uint inum) {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int n;
+
+  if(inum == 0 || inum >= sb.ninodes)
+    panic("iget: bad inum");
+
+  pthread_mutex_lock(&icachelock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(int ino = 1; ino < sb.ninodes; ino++) {
-    ip = &inodes[ino];
-    if(ip->ref > 0 && ip->inum == inum) {
+  for(ip = icache.hash[inum % NIBUCKET]; ip; ip = ip->hnext)
+    if(ip->inum == inum){
       ip->ref++;
+      pthread_mutex_unlock(&icachelock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Recycle an inode cache entry: the next unreferenced one.
+  for(n = 0; n < NINODE; n++){
+    ip = &icache.inode[icache.hand];
+    icache.hand = (icache.hand + 1) % NINODE;
+    if(ip->ref == 0)
+      break;
+  }
+  if(n == NINODE)
     panic("iget: no inodes");
+  if(ip->inum)
+    ihashremove(ip);
+  if(ip->delay)
+    panic("iget: recycling an inode with delayed blocks");
 
-  ip = empty;
   ip->inum = inum;
   ip->ref = 1;
-  //ip->flags = 0;
+  ip->flags = 0;
+  ip->goal = 0;
+  ip->hnext = icache.hash[inum % NIBUCKET];
+  icache.hash[inum % NIBUCKET] = ip;
+  pthread_mutex_unlock(&icachelock);
   return ip;
 }
 
@@ -191,62 +672,483 @@ struct inode* iget(uint inum) {
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode* idup(struct inode *ip) {
+  pthread_mutex_lock(&icachelock);
   ip->ref++;
+  pthread_mutex_unlock(&icachelock);
   return ip;
 }
 
+// Lock the given inode, waiting while another thread holds it.
+// Reads the inode from disk if necessary.
+void ilock(struct inode *ip) {
+  struct buf *bp;
+  struct dinode *dip;
+  int valid;
+
+  if(ip == 0)
+    panic("ilock");
+
+  pthread_mutex_lock(&icachelock);
+  if(ip->ref < 1)
+    panic("ilock");
+  while(ip->flags & I_BUSY)
+    pthread_cond_wait(&icachecond, &icachelock);
+  ip->flags |= I_BUSY;
+  valid = ip->flags & I_VALID;
+  pthread_mutex_unlock(&icachelock);
+
+  if(!valid){
+    bp = bread(IBLOCK(ip->inum));
+    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    ip->type = dip->type;
+    ip->nlink = dip->nlink;
+    ip->size = dip->size;
+    ip->ctime = dip->ctime;
+    ip->mtime = dip->mtime;
+    memmove(ip->blocks, dip->blocks, sizeof(ip->blocks));
+    ip->unwritten = dip->unwritten;
+    brelse(bp);
+    pthread_mutex_lock(&icachelock);
+    ip->flags |= I_VALID;
+    pthread_mutex_unlock(&icachelock);
+  }
+}
+
+// Unlock the given inode.
+void iunlock(struct inode *ip) {
+  if(ip == 0)
+    panic("iunlock");
+
+  pthread_mutex_lock(&icachelock);
+  if(!(ip->flags & I_BUSY) || ip->ref < 1)
+    panic("iunlock");
+  ip->flags &= ~I_BUSY;
+  pthread_cond_broadcast(&icachecond);
+  pthread_mutex_unlock(&icachelock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
+// The root is never freed: images made before create gave it a
+// link it still has nlink 0.
 void iput(struct inode *ip) {
-  if(ip->ref == 1 && /*(ip->flags & I_VALID) &&*/ ip->nlink == 0){
+  uint inum;
+
+  pthread_mutex_lock(&icachelock);
+  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0 && ip->inum != ROOTINO){
     // inode has no links: truncate and free inode.
-    ip->type = 0;
-    //ip->flags = 0;
+    if(ip->flags & I_BUSY)
+      panic("iput busy");
+    ip->flags |= I_BUSY;
+    pthread_mutex_unlock(&icachelock);
+    if(ip->type == T_DIR){
+      diridxdrop(ip->inum);
+      dcpurge(ip->inum);
+    }
+    idelfree(ip);
     itrunc(ip);
+    ip->type = 0;
+    iupdate(ip);
+    // Unhash it before freeing its number, or an ialloc of that
+    // number could find this entry in iget.
+    pthread_mutex_lock(&icachelock);
+    ihashremove(ip);
+    inum = ip->inum;
+    ip->inum = 0;
+    ip->flags = 0;
+    pthread_cond_broadcast(&icachecond);
+    pthread_mutex_unlock(&icachelock);
+    pthread_mutex_lock(&bitmaplock);
+    inodebitmap[inum/32] &= ~(1u << (inum % 32));
+    fsdirty |= D_IBITMAP;
+    pthread_mutex_unlock(&bitmaplock);
+    pthread_mutex_lock(&icachelock);
   }
   ip->ref--;
+  pthread_mutex_unlock(&icachelock);
+}
+
+// Common idiom: unlock, then put.
+void iunlockput(struct inode *ip) {
+  iunlock(ip);
+  iput(ip);
 }
 
 // Inode content
 //
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->blocks[].  
-// We do not implement NINDIRECT. If so, the next NINDIRECT blocks are 
+// are listed in ip->blocks[]. The next NINDIRECT blocks are
 // listed in block ip->blocks[NDIRECT].
+// With SB_DINDIRECT there is one less direct block: ip->blocks[NDIRECT-1]
+// is the single indirect block and ip->blocks[NDIRECT] lists NINDIRECT
+// more indirect blocks.
+// Indirect blocks are read through the buffer cache, so walking a file
+// in order finds its indirect block cached after the first access.
+
+// Number of direct blocks in an inode.
+static uint ndirect() {
+  return (sb.flags & SB_DINDIRECT) ? NDIRECT-1 : NDIRECT;
+}
+
+// Is the file system keeping a journal? (sb.nlog blocks of log)
+int fsjournaled() {
+  return sb.nlog > 0;
+}
+
+// Largest file size in blocks. An extent file may stop short of it
+// when its extents run out - see emap.
+static uint maxfile() {
+  if(sb.flags & SB_EXTENT)
+    return sb.size;
+  return (sb.flags & SB_DINDIRECT) ? MAXFILE_DIND : MAXFILE;
+}
+
+// Where to allocate the next block of ip: right after the last block
+// allocated for it, or for its first, at the start of its group, so a
+// file's blocks stay together and near its inode and directory.
+// ip->goal is not on disk, so an inode read back in starts from its
+// last mapped block.
+static uint igoal(struct inode *ip) {
+  uint n, last;
+
+  if(ip->goal == 0 && (n = imapped(ip)) > 0 && (last = blookup(ip, n-1)) != 0)
+    ip->goal = last + 1;
+  return ip->goal ? ip->goal : max(blo(), igroup(ip->inum) * BPB);
+}
+
+// Allocate a block for ip at or after its goal; 0 if the disk is full.
+static uint iballoc(struct inode *ip) {
+  uint n, bi = brun(igoal(ip), 1, &n);
+
+  if(n == 0)
+    return 0;
+  ip->goal = bi + 1;
+  return bi;
+}
+
+// Fill in the block pointer *p of ip if it is empty, with block alloc
+// or, if alloc is 0, a newly allocated block. Return the block *p names,
+// or 0 if the disk is full. An alloc that turns out not to be needed
+// is freed.
+static uint bset(struct inode *ip, uint *p, uint alloc) {
+  if(*p){
+    if(alloc)
+      bfree(alloc);
+    return *p;
+  }
+  return *p = alloc ? alloc : iballoc(ip);
+}
+
+// Return entry bn of the indirect block at *paddr of ip, allocating
+// the indirect block and, as bset does, the entry as needed; 0 if the
+// disk is full. alloc is not used then.
+static uint indirect(struct inode *ip, uint *paddr, uint bn, uint alloc) {
+  uint addr, *a;
+  struct buf *b;
+  int empty;
+
+  if((addr = bset(ip, paddr, 0)) == 0)
+    return 0;
+  b = bread(addr);
+  a = (uint*)b->data;
+  empty = a[bn] == 0;
+  addr = bset(ip, &a[bn], alloc);
+  if(empty && addr)
+    log_write(b);
+  brelse(b);
+  return addr;
+}
+
+// Extent-mapped inodes (SB_EXTENT) list runs of blocks instead:
+// NIEXTENT extents in ip->blocks[], then NXEXTENT more in the extent
+// block ip->blocks[NDIRECT]. The extents in order cover the file.
+// Return the disk address of block bn of ip and set *len to the number
+// of blocks from there to the end of its extent. If bn is the first
+// unmapped block, allocate a run of up to want blocks for it, growing
+// the last extent when the new run directly follows it. Once every
+// extent is used, only growing the last one in place is possible;
+// if its next block is taken, or the disk is full, return 0 with *len 0.
+static uint emap(struct inode *ip, uint bn, uint want, uint *len) {
+  struct extent *e = (struct extent*)ip->blocks, *last = 0;
+  struct buf *b = 0;
+  uint i, ne = NIEXTENT, addr, got;
+
+  for(;;){
+    for(i = 0; i < ne && e[i].len > 0; i++){
+      if(bn < e[i].len){
+        addr = e[i].start + bn;
+        *len = e[i].len - bn;
+        if(b)
+          brelse(b);
+        return addr;
+      }
+      bn -= e[i].len;
+      last = &e[i];
+    }
+    if(i < ne || b != 0 || ip->blocks[NDIRECT] == 0)
+      break;
+    b = bread(ip->blocks[NDIRECT]);
+    e = (struct extent*)b->data;
+    ne = NXEXTENT;
+  }
+
+  // Block bn is past the mapped blocks.
+  if(bn != 0)
+    panic("bmap: hole in extent file");
+  if(i == ne && b){
+    addr = last->start + last->len;
+    got = bgrow(addr, want);
+  } else
+    addr = brun(last ? last->start + last->len : igoal(ip), want, &got);
+  if(got == 0){  // the next block is taken, or the disk is full
+    if(b)
+      brelse(b);
+    *len = 0;
+    return 0;
+  }
+  ip->goal = addr + got;
+  if(last && addr == last->start + last->len){
+    last->len += got;
+  } else {
+    if(i == ne){
+      if((ip->blocks[NDIRECT] = iballoc(ip)) == 0){
+        while(got > 0)
+          bfree(addr + --got);
+        *len = 0;
+        return 0;
+      }
+      b = bread(ip->blocks[NDIRECT]);
+      e = (struct extent*)b->data;
+      i = 0;
+    }
+    e[i].start = addr;
+    e[i].len = got;
+  }
+  if(b){
+    log_write(b);
+    brelse(b);
+  }
+  *len = got;
+  return addr;
+}
+
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-static uint bmap(struct inode *ip, uint bn) {
-  uint addr;
+// If there is no such block, bmap allocates one, using block alloc
+// if that is not 0. Return 0 if the disk is full; alloc is not used then.
+static uint bmap(struct inode *ip, uint bn, uint alloc) {
+  uint addr, nd = ndirect();
 
-  if(bn < NDIRECT){
-    if((addr = ip->blocks[bn]) == 0)
-      ip->blocks[bn] = addr = balloc();
-    return addr;
+  if(sb.flags & SB_EXTENT)
+    return emap(ip, bn, 1, &addr);
+
+  if(bn < nd)
+    return bset(ip, &ip->blocks[bn], alloc);
+  bn -= nd;
+
+  if(bn < NINDIRECT)
+    return indirect(ip, &ip->blocks[nd], bn, alloc);
+  bn -= NINDIRECT;
+
+  if((sb.flags & SB_DINDIRECT) && bn < NDINDIRECT){
+    // Find the indirect block in the double indirect block.
+    if((addr = indirect(ip, &ip->blocks[NDIRECT], bn / NINDIRECT, 0)) == 0)
+      return 0;
+    return indirect(ip, &addr, bn % NINDIRECT, alloc);
   }
 
   panic("bmap: out of range");
   return -1;
 }
 
+// Return the disk address of block bn of ip, or 0 if it has none.
+// Unlike bmap, nothing is allocated.
+static uint blookup(struct inode *ip, uint bn) {
+  struct extent *e = (struct extent*)ip->blocks;
+  uint i, addr = 0, nd = ndirect();
+  struct buf *b;
+
+  if(sb.flags & SB_EXTENT){
+    for(i = 0; i < NIEXTENT && e[i].len > 0; bn -= e[i].len, i++)
+      if(bn < e[i].len)
+        return e[i].start + bn;
+    if(i < NIEXTENT || ip->blocks[NDIRECT] == 0)
+      return 0;
+    b = bread(ip->blocks[NDIRECT]);
+    e = (struct extent*)b->data;
+    for(i = 0; i < NXEXTENT && e[i].len > 0; bn -= e[i].len, i++)
+      if(bn < e[i].len){
+        addr = e[i].start + bn;
+        break;
+      }
+    brelse(b);
+    return addr;
+  }
+
+  if(bn < nd)
+    return ip->blocks[bn];
+  bn -= nd;
+  if(bn < NINDIRECT)
+    addr = ip->blocks[nd];
+  else if((sb.flags & SB_DINDIRECT) && bn - NINDIRECT < NDINDIRECT &&
+          ip->blocks[NDIRECT] != 0){
+    bn -= NINDIRECT;
+    b = bread(ip->blocks[NDIRECT]);
+    addr = ((uint*)b->data)[bn / NINDIRECT];
+    brelse(b);
+    bn %= NINDIRECT;
+  }
+  if(addr == 0)
+    return 0;
+  b = bread(addr);
+  addr = ((uint*)b->data)[bn];
+  brelse(b);
+  return addr;
+}
+
+// Free the indirect block addr and, depth levels down, the blocks it lists.
+static void ifree(uint addr, int depth) {
+  struct buf *b;
+  uint *a;
+
+  if(depth > 0){
+    b = bread(addr);
+    a = (uint*)b->data;
+    for(int j = 0; j < NINDIRECT; j++)
+      if(a[j])
+        ifree(a[j], depth-1);
+    brelse(b);
+  }
+  bfree(addr);
+}
+
+// Append the disk run (addr, len) to the nr runs in runs[],
+// merging it with the last run if it follows on. Return the new count.
+static int addrun(struct extent *runs, int nr, uint addr, uint len) {
+  if(nr > 0 && runs[nr-1].start + runs[nr-1].len == addr){
+    runs[nr-1].len += len;
+    return nr;
+  }
+  runs[nr].start = addr;
+  runs[nr].len = len;
+  return nr+1;
+}
+
+// Plan a transfer of the nb (at most NPLAN) file blocks of ip starting
+// at bn. All of them are mapped up front; the ones past the end of the
+// file are allocated with one balloc_n, so they land in as few runs as
+// the free space allows. Fill runs[] with the disk runs holding the
+// blocks, in file order, and return how many there are. The runs hold
+// fewer than nb blocks if an extent file runs out of extents or the
+// disk is full.
+static int bplan(struct inode *ip, uint bn, uint nb, struct extent *runs) {
+  struct extent pool[NPLAN];
+  uint i, len, addr, alloc, mapped;
+  int nr = 0, np = 0, pi = 0;
+
+  if(sb.flags & SB_EXTENT){
+    for(i = 0; i < nb; i += len){
+      if((addr = emap(ip, bn+i, nb-i, &len)) == 0)
+        break;
+      len = min(len, nb-i);
+      nr = addrun(runs, nr, addr, len);
+    }
+    return nr;
+  }
+
+  // Blocks past the end of the file are not allocated yet, unless
+  // ifallocate allocated them. The allocated blocks are always the
+  // first ones of the file, so they end where a lookup comes up empty.
+  mapped = imapped(ip);
+  if(mapped < bn && blookup(ip, bn-1))
+    mapped = bn;
+  while(mapped < bn + nb && blookup(ip, mapped))
+    mapped++;
+  if(bn + nb > mapped){
+    np = balloc_n(igoal(ip), bn + nb - (bn > mapped ? bn : mapped), pool, NPLAN);
+    if(np > 0)
+      ip->goal = pool[np-1].start + pool[np-1].len;
+  }
+  for(i = 0; i < nb; i++){
+    alloc = 0;
+    if(bn+i >= mapped){
+      if(pi == np)  // the disk is full
+        break;
+      alloc = pool[pi].start++;
+      if(--pool[pi].len == 0)
+        pi++;
+    }
+    // With the disk all but full, the pool can hold the last free
+    // blocks: give them back from its end until an indirect block fits.
+    while((addr = bmap(ip, bn+i, alloc)) == 0 && pi < np){
+      bfree(pool[np-1].start + --pool[np-1].len);
+      if(pool[np-1].len == 0)
+        np--;
+    }
+    if(addr == 0){
+      if(alloc)
+        bfree(alloc);
+      break;
+    }
+    nr = addrun(runs, nr, addr, 1);
+  }
+  return nr;
+}
+
+// Free every block listed in the n extents e.
+static void efree(struct extent *e, uint n) {
+  for(uint i = 0; i < n && e[i].len > 0; i++)
+    for(uint k = 0; k < e[i].len; k++)
+      bfree(e[i].start + k);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
 static void itrunc(struct inode *ip) {
-  for(int i = 0; i < NDIRECT; i++){
+  uint nd = ndirect();
+  struct buf *b;
+
+  if(sb.flags & SB_EXTENT){
+    efree((struct extent*)ip->blocks, NIEXTENT);
+    if(ip->blocks[NDIRECT]){
+      b = bread(ip->blocks[NDIRECT]);
+      efree((struct extent*)b->data, NXEXTENT);
+      brelse(b);
+      bfree(ip->blocks[NDIRECT]);
+    }
+    memset(ip->blocks, 0, sizeof(ip->blocks));
+    ip->size = 0;
+    ip->unwritten = 0;
+    iupdate(ip);
+    return;
+  }
+
+  for(int i = 0; i < nd; i++){
     if(ip->blocks[i]){
       bfree(ip->blocks[i]);
       ip->blocks[i] = 0;
     }
   }
 
+  if(ip->blocks[nd]){
+    ifree(ip->blocks[nd], 1);
+    ip->blocks[nd] = 0;
+  }
+
+  if((sb.flags & SB_DINDIRECT) && ip->blocks[NDIRECT]){
+    ifree(ip->blocks[NDIRECT], 2);
+    ip->blocks[NDIRECT] = 0;
+  }
+
   ip->size = 0;
-  // iupdate(ip); // not needed - update inodes on disk on exit
+  ip->unwritten = 0;
+  iupdate(ip);
 }
 
 // Copy stat information from inode.
@@ -258,49 +1160,413 @@ void stati(struct inode *ip, struct tfs_stat *st)
   st->size = ip->size;
 }
 
+/*
+ * Delayed allocation.
+ * With fsdelalloc, data written past a file's last disk block is kept
+ * in buffers from bgetdelay, chained through hnext in ip->delay in file
+ * order, with each buffer's sector holding its file block number.
+ * No disk blocks are allocated until the file is closed, writefsinfo
+ * runs, or the cache has no more such buffers to give. idelalloc then
+ * allocates all of them with balloc_n, in one run if the free space
+ * allows, and the bitmap changes once for the whole batch.
+ * The delayed blocks are always the last blocks of the file, and the
+ * size written to disk stops before them - see iupdate.
+ */
+static int delalloc;
+
+// Turn on delayed allocation for regular files. It stays on until the
+// program exits. A file system with a log allocates as it writes.
+void fsdelalloc(void) {
+  delalloc = 1;
+}
+
+// Does writei delay allocation for ip?
+// Not while ip has unwritten blocks, which delayed ones would follow.
+static int idelayed(struct inode *ip) {
+  return delalloc && !fsjournaled() && ip->type == T_FILE && ip->unwritten == 0;
+}
+
+// Number of blocks of ip that have disk blocks.
+static uint imapped(struct inode *ip) {
+  return ip->delay ? ip->delay->sector : (ip->size + BSIZE-1) / BSIZE;
+}
+
+// Number of blocks of ip that have disk blocks, counting the ones
+// ifallocate gave it past the end of the file. The allocated blocks
+// are always the first ones, so a binary search finds where they end.
+static uint iallocated(struct inode *ip) {
+  uint lo = imapped(ip), hi = maxfile(), mid;
+
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(blookup(ip, mid))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// The first block of ip that ifallocate allocated and nothing has
+// written since, or ~0 if there is none. It and every allocated block
+// after it read as zeros without touching the disk, where they hold
+// whatever their last owner left. The boundary is kept in the inode,
+// so it survives a crash along with the allocation.
+static uint iunwritten(struct inode *ip) {
+  return ip->unwritten ? ip->unwritten - 1 : ~0u;
+}
+
+// Note that the blocks of ip before byte off are written, which must
+// include every one from iunwritten on: move the boundary past them,
+// or drop it once no allocated block is left after it.
+static void iwritten(struct inode *ip, uint off) {
+  uint bn = (off + BSIZE-1) / BSIZE;
+
+  if(ip->unwritten && bn > iunwritten(ip))
+    ip->unwritten = blookup(ip, bn) ? bn + 1 : 0;
+}
+
+// Drop ip's delayed blocks without writing them.
+static void idelfree(struct inode *ip) {
+  struct buf *d;
+
+  while((d = ip->delay) != 0){
+    ip->delay = d->hnext;
+    brelsedelay(d);
+  }
+  ip->ndelay = 0;
+}
+
+// Give ip's delayed blocks disk blocks, in as few runs as bplan can
+// get from balloc_n, and copy their data into the cache under them.
+// If an extent file runs out of extents or the disk fills up, the
+// blocks that cannot be placed are dropped and the file ends before them, as if writing
+// them back had failed. Caller holds the inode lock.
+void idelalloc(struct inode *ip) {
+  struct extent runs[NPLAN];
+  struct buf *d, *b;
+  uint k;
+  int r, nr;
+
+  if(ip->delay == 0)
+    return;
+  while(ip->delay){
+    nr = bplan(ip, ip->delay->sector, min(ip->ndelay, NPLAN), runs);
+    if(nr == 0){
+      ip->size = ip->delay->sector * BSIZE;
+      idelfree(ip);
+      break;
+    }
+    for(r = 0; r < nr; r++){
+      for(k = 0; k < runs[r].len; k++){
+        d = ip->delay;
+        ip->delay = d->hnext;
+        ip->ndelay--;
+        b = bget(runs[r].start + k);  // fresh, so no read
+        memmove(b->data, d->data, BSIZE);
+        log_write(b);
+        brelse(b);
+        brelsedelay(d);
+      }
+    }
+  }
+  iupdate(ip);
+}
+
+// idelalloc every inode in use, before writefsinfo writes the bitmaps.
+static void idelallocall(void) {
+  struct inode *ip;
+
+  if(!delalloc)
+    return;
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    pthread_mutex_lock(&icachelock);
+    if(ip->ref == 0){
+      pthread_mutex_unlock(&icachelock);
+      continue;
+    }
+    ip->ref++;
+    pthread_mutex_unlock(&icachelock);
+    ilock(ip);
+    idelalloc(ip);
+    iunlock(ip);
+    iput(ip);
+  }
+}
+
+// Copy n bytes at off of ip's delayed blocks to dst.
+static void idelread(struct inode *ip, char *dst, uint off, uint n) {
+  struct buf *d = ip->delay;
+  uint m;
+
+  for(; n > 0; n -= m, off += m, dst += m){
+    while(d->sector != off / BSIZE)
+      d = d->hnext;
+    m = min(n, BSIZE - off%BSIZE);
+    memmove(dst, d->data + off%BSIZE, m);
+  }
+}
+
+// Write n bytes from src at off, which is past ip's last disk block,
+// into delayed blocks, adding blocks as the file grows. If the cache
+// has no buffer to spare, allocate ip's delayed blocks to free some.
+// Return how many bytes were written; fewer than n if there is still
+// no buffer.
+static uint idelwrite(struct inode *ip, char *src, uint off, uint n) {
+  struct buf *d, **pp;
+  uint tot, m, bn;
+
+  for(tot = 0; tot < n; tot += m, off += m, src += m){
+    bn = off / BSIZE;
+    for(pp = &ip->delay; *pp && (*pp)->sector < bn; pp = &(*pp)->hnext)
+      ;
+    if((d = *pp) == 0){
+      if((d = bgetdelay()) == 0 && ip->delay){
+        idelalloc(ip);
+        if(off > ip->size)  // it dropped blocks it could not place
+          break;
+        d = bgetdelay();
+        pp = &ip->delay;
+      }
+      if(d == 0)
+        break;
+      if(bn != imapped(ip) + ip->ndelay)
+        panic("idelwrite: hole");
+      d->sector = bn;
+      d->hnext = 0;
+      *pp = d;
+      ip->ndelay++;
+    }
+    m = min(n - tot, BSIZE - off%BSIZE);
+    memmove(d->data + off%BSIZE, src, m);
+    if(off + m > ip->size)
+      ip->size = off + m;
+  }
+  return tot;
+}
+
 // Read data from inode.
+// The blocks are planned with bplan and each disk run is read with
+// breadv, up to MAXBIO blocks at a time. Delayed blocks are copied
+// from their buffers, and unwritten ones read as zeros.
 int readi(struct inode *ip, char *dst, uint off, uint n) {
-  uint tot, m;
+  uint tot, m, i, k, len, nd = 0;
+  struct extent runs[NPLAN];
+  struct buf *bp[MAXBIO];
+  int r, nr;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->delay && (u64)off + n > (u64)imapped(ip)*BSIZE){
+    nd = min(n, off + n - imapped(ip)*BSIZE);
+    idelread(ip, dst + n - nd, off + n - nd, nd);
+    n -= nd;
+  } else if((u64)off + n > (u64)iunwritten(ip)*BSIZE){
+    nd = min(n, off + n - iunwritten(ip)*BSIZE);
+    memset(dst + n - nd, 0, nd);  // unwritten blocks, no I/O
+    n -= nd;
+  }
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    int s = bread(bmap(ip, off/BSIZE), buf);
-    if (s < 0)
-      panic("bread fail");
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, buf + off%BSIZE, m);
+  for(tot=0; tot<n; ){
+    nr = bplan(ip, off/BSIZE, min(NPLAN, (off%BSIZE + n - tot + BSIZE-1)/BSIZE), runs);
+    for(r = 0; r < nr; r++){
+      for(k = 0; k < runs[r].len; k += len){
+        len = breadv(runs[r].start + k, min(runs[r].len - k, MAXBIO), bp);
+        for(i=0; i<len; i++, tot+=m, off+=m, dst+=m){
+          m = min(n - tot, BSIZE - off%BSIZE);
+          memmove(dst, bp[i]->data + off%BSIZE, m);
+          brelse(bp[i]);
+        }
+      }
+    }
   }
-  return n;
+  return n + nd;
+}
+
+// Hint that the n blocks of ip from block bn on will be read soon;
+// see breadahead. Only blocks the file has written are planned, so
+// nothing is allocated. Caller holds the inode lock.
+void ireadahead(struct inode *ip, uint bn, uint n) {
+  struct extent runs[NPLAN];
+  uint nb = min(imapped(ip), iunwritten(ip));
+  int r, nr;
+
+  if(bn >= nb)
+    return;
+  n = min(min(n, nb - bn), RAMAX);
+  nr = bplan(ip, bn, n, runs);
+  for(r = 0; r < nr; r++)
+    breadahead(runs[r].start, runs[r].len);
+}
+
+// Write n bytes from src at off to blocks of ip that have disk blocks
+// or, past the end of the file, get them now.
+// The blocks are planned with bplan, allocating new ones together.
+// Runs of whole blocks go from src straight to disk with bwritedirect,
+// unless there is a log, which every block must go through, or the
+// run is short and bflusher is there to write the cache back later.
+// Other blocks are changed in the cache; only partial ones are read,
+// unless unwritten, and those start from zeros. Unwritten blocks
+// before off must have been zeroed - see izero.
+// Return how many bytes were written; fewer than n if an extent file
+// ran out of extents or no block could be allocated.
+static uint wblocks(struct inode *ip, char *src, uint off, uint n) {
+  uint tot, m, k, addr, end, nb, got;
+  struct extent runs[NPLAN];
+  struct buf *b;
+  int r, nr;
+
+  for(tot=0; tot<n; ){
+    nb = min(NPLAN, (off%BSIZE + n - tot + BSIZE-1)/BSIZE);
+    nr = bplan(ip, off/BSIZE, nb, runs);
+    for(got = 0, r = 0; r < nr; r++){
+      got += runs[r].len;
+      addr = runs[r].start;
+      for(end = addr + runs[r].len; addr < end; addr+=k, tot+=m, off+=m, src+=m){
+        k = min(end - addr, (n - tot)/BSIZE);
+        if(off%BSIZE == 0 && k > 0 && !fsjournaled() &&
+           (k >= MAXBIO || !bflushing())){
+          bwritedirect(addr, k, src);
+          m = k*BSIZE;
+          continue;
+        }
+        k = 1;
+        m = min(n - tot, BSIZE - off%BSIZE);
+        if(m == BSIZE)
+          b = bget(addr);
+        else if(off/BSIZE >= iunwritten(ip)){  // the disk copy is stale
+          b = bget(addr);
+          memset(b->data, 0, BSIZE);
+        } else
+          b = bread(addr);
+        memmove(b->data + off%BSIZE, src, m);
+        log_write(b);
+        brelse(b);
+      }
+    }
+    if(off > ip->size)
+      ip->size = off;
+    iwritten(ip, off);
+    if(got < nb)
+      break;
+  }
+  return tot;
+}
+
+// Zero the unwritten blocks of ip before the one holding byte off, so
+// a write at off can move the boundary past them (see iwritten).
+// Without a log they are all done at once. With one they go through
+// it, so a call does no more than a transaction holds beside the
+// inode; the caller repeats, a transaction each, until it returns 0.
+// Return how many blocks were zeroed. Caller holds the inode lock.
+int izero(struct inode *ip, uint off) {
+  struct extent runs[NPLAN];
+  uint bn = iunwritten(ip), end = off / BSIZE, tot = 0, k;
+  struct buf *b;
+  int r, nr;
+
+  if(bn >= end)
+    return 0;
+  if(fsjournaled())
+    end = min(end, bn + MAXOPBLOCKS-1);
+  for(; bn < end; bn += NPLAN){
+    nr = bplan(ip, bn, min(end - bn, NPLAN), runs);
+    for(r = 0; r < nr; r++){
+      for(k = 0; k < runs[r].len; k++, tot++){
+        b = bget(runs[r].start + k);
+        memset(b->data, 0, BSIZE);
+        log_write(b);
+        brelse(b);
+      }
+    }
+  }
+  iwritten(ip, end*BSIZE);
+  iupdate(ip);
+  return tot;
+}
+
+// Allocate disk blocks for bytes [off, off+n) of ip, and for the
+// blocks before them that have none, in as few runs as balloc_n can
+// make. The new blocks are unwritten: they read as zeros, with no disk
+// I/O, until they are written (see iunwritten). With a log, a call
+// allocates up to NPLAN blocks, so the indirect and bitmap blocks it
+// changes fit in one transaction, and the caller repeats, a
+// transaction each, while it returns 1. Once all are allocated the
+// file grows to off+n, unless keepsize, and it returns 0.
+// Return -1 if the file cannot be that big, the disk is full or, for
+// an extent file, its extents run out.
+int ifallocate(struct inode *ip, uint off, uint n, int keepsize) {
+  struct extent runs[NPLAN];
+  uint bn, nb, end, got;
+  int nr;
+
+  if(off + n < off || off + n > (u64)maxfile()*BSIZE)
+    return -1;
+  idelalloc(ip);  // delayed blocks come first in the file
+  end = (off + n + BSIZE-1) / BSIZE;
+  for(bn = iallocated(ip); bn < end; bn += nb){
+    if(ip->unwritten == 0)
+      ip->unwritten = bn + 1;
+    nb = min(end - bn, NPLAN);
+    for(got = 0, nr = bplan(ip, bn, nb, runs); nr > 0; nr--)
+      got += runs[nr-1].len;
+    if(got < nb || (fsjournaled() && bn + nb < end)){
+      iupdate(ip);
+      // A short run with a log can be the op's bitmap blocks
+      // running out; the next transaction gets more.
+      return got > 0 && fsjournaled() ? 1 : -1;
+    }
+  }
+  if(!keepsize && off + n > ip->size)
+    ip->size = off + n;
+  iupdate(ip);
+  return 0;
 }
 
 // Write data to inode.
+// With delayed allocation, the part past the last disk block goes to
+// delayed blocks (idelwrite) and the rest to wblocks.
+// Return the number of bytes written, which is short if an extent
+// file runs out of extents or no block can be allocated.
 int writei(struct inode *ip, char *src, uint off, uint n) {
-  uint tot, m;
+  uint tot, m, w, lim;
 //cprintf("inside writei: type=%x major=%x, func addr: %x\n", ip->type, ip->major, devsw[ip->major].write);
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > (u64)maxfile()*BSIZE)
     return -1;
+  // Zero the unwritten blocks before off. With a log, filewrite has,
+  // a transaction at a time.
+  if(fsjournaled() && off/BSIZE > iunwritten(ip))
+    panic("writei: unwritten blocks before off");
+  izero(ip, off);
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    int s = bread(bmap(ip, off/BSIZE), buf);
-    if (s < 0)
-      panic("bread fail");
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(buf + off%BSIZE, src, m);
-    bwrite(bmap(ip, off/BSIZE), buf); // HERE
+  // If idelalloc drops delayed blocks it cannot place, the file can
+  // end before off; the write stops there.
+  for(tot=0; tot<n && off <= ip->size; tot+=m, off+=m, src+=m){
+    m = 0;
+    lim = imapped(ip)*BSIZE;
+    if(idelayed(ip) && off >= lim)
+      m = idelwrite(ip, src, off, n - tot);
+    if(m == 0 && off <= ip->size){
+      w = n - tot;
+      if(idelayed(ip) && off < lim)
+        w = min(w, lim - off);
+      if((m = wblocks(ip, src, off, w)) < w){
+        tot += m;
+        break;
+      }
+    }
   }
 
-  if(n > 0 && off > ip->size){
-    ip->size = off;
-    // iupdate(ip); // not needed - update inodes on disk on exit
-  }
-  return n;
+  // Write the inode back even if the size did not change:
+  // bplan may have put new blocks in ip->blocks.
+  if(n > 0)
+    iupdate(ip);
+  return tot;
 }
 
 // Directories
@@ -308,63 +1574,364 @@ int namecmp(const char *s, const char *t) {
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode* dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+/*
+ * Directory index.
+ * Each directory that is searched gets an in-memory hash index: a copy
+ * of its dirents, read with one readi, chained by hash of name. The
+ * index is built on the first lookup and kept current by dirlink and
+ * dirunlink, so lookups and finding a free slot do not read the disk.
+ * NDIRIDX directories are indexed at once; the least recently used
+ * index that no thread is using is dropped to make room.
+ * diridxlock only guards which directory each slot holds, ref and
+ * used; the index itself is read and changed under the directory's
+ * inode lock, so operations on different directories run in parallel.
+ */
+struct diridx {
+  uint inum;          // directory inode number, 0 if slot unused
+  uint ref;           // threads using it, between diridxget and diridxput
+  uint used;          // tick of last use
+  uint n;             // dirents in de[]
+  uint cap;
+  struct dirent *de;  // copy of the directory's entries
+  int *next;          // hash chain through de[], -1 ends it
+  int *head;          // nbucket chain heads
+  uint nbucket;       // power of 2
+  uint freehint;      // no free dirent before de[freehint]
+};
+static struct diridx diridx[NDIRIDX];
+static uint diridxtick;
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+static uint namehash(const char *name) {
+  uint h = 2166136261u;  // FNV-1a
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619u;
+  return h;
+}
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
+// Hash de[i] into its chain.
+static void diridxhash(struct diridx *x, int i) {
+  uint h = namehash(x->de[i].name) & (x->nbucket - 1);
+  x->next[i] = x->head[h];
+  x->head[h] = i;
+}
 
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
+// Remove de[i] from its chain.
+static void diridxunhash(struct diridx *x, int i) {
+  int *p = &x->head[namehash(x->de[i].name) & (x->nbucket - 1)];
+  for(; *p >= 0; p = &x->next[*p])
+    if(*p == i){
+      *p = x->next[i];
+      return;
+    }
+}
+
+// Make room for n dirents, growing the chains to keep them short.
+static void diridxgrow(struct diridx *x, uint n) {
+  uint i;
+
+  if(x->cap > 0 && n <= x->cap)
+    return;
+  x->cap = x->cap ? x->cap : 16;
+  while(x->cap < n)
+    x->cap *= 2;
+  x->de = realloc(x->de, x->cap * sizeof(struct dirent));
+  x->next = realloc(x->next, x->cap * sizeof(int));
+  if(x->cap / 2 > x->nbucket){
+    x->nbucket = x->cap / 2;
+    free(x->head);
+    x->head = malloc(x->nbucket * sizeof(int));
+    if(x->head)
+      for(i = 0; i < x->nbucket; i++)
+        x->head[i] = -1;
+    for(i = 0; x->head && i < x->n; i++)
+      if(x->de[i].inum)
+        diridxhash(x, i);
+  }
+  if(x->de == 0 || x->next == 0 || x->head == 0)
+    panic("diridx: out of memory");
+}
+
+static void diridxfree(struct diridx *x) {
+  free(x->de);
+  free(x->next);
+  free(x->head);
+  memset(x, 0, sizeof(*x));
+}
+
+// Drop every index, e.g. when a new file system is read.
+// Only at mount, so no lock.
+static void diridxinit(void) {
+  for(int i = 0; i < NDIRIDX; i++)
+    diridxfree(&diridx[i]);
+}
+
+// Drop the index of directory inum, if there is one.
+static void diridxdrop(uint inum) {
+  pthread_mutex_lock(&diridxlock);
+  for(int i = 0; i < NDIRIDX; i++)
+    if(diridx[i].inum == inum)
+      diridxfree(&diridx[i]);
+  pthread_mutex_unlock(&diridxlock);
+}
+
+// Return the index for directory dp, building it if needed, and keep
+// it from being dropped until diridxput. If every slot is in use,
+// wait for one. Caller holds the lock on dp.
+static struct diridx* diridxget(struct inode *dp) {
+  struct diridx *x, *victim;
+  uint i, n;
+
+  pthread_mutex_lock(&diridxlock);
+  for(;;){
+    victim = 0;
+    for(x = diridx; x < diridx + NDIRIDX; x++){
+      if(x->inum == dp->inum){
+        x->ref++;
+        x->used = ++diridxtick;
+        pthread_mutex_unlock(&diridxlock);
+        return x;
+      }
+      if(x->ref == 0 && (victim == 0 || x->used < victim->used))
+        victim = x;
+    }
+    if(victim)
+      break;
+    pthread_cond_wait(&diridxcond, &diridxlock);
+  }
+  x = victim;
+  diridxfree(x);
+  x->inum = dp->inum;
+  x->ref = 1;
+  x->used = ++diridxtick;
+  pthread_mutex_unlock(&diridxlock);
+
+  // The slot is ours; dp's lock keeps the directory still while we read it.
+  n = dp->size / sizeof(struct dirent);
+  diridxgrow(x, n);  // before x->n is set: nothing to rehash yet
+  if(readi(dp, (char*)x->de, 0, n * sizeof(struct dirent)) != n * sizeof(struct dirent))
+    panic("diridx read");
+  x->n = n;
+  for(i = 0; i < x->n; i++)
+    if(x->de[i].inum)
+      diridxhash(x, i);
+  return x;
+}
+
+// Done with index x from diridxget.
+static void diridxput(struct diridx *x) {
+  pthread_mutex_lock(&diridxlock);
+  if(--x->ref == 0)
+    pthread_cond_broadcast(&diridxcond);
+  pthread_mutex_unlock(&diridxlock);
+}
+
+// Return the inum of name in the index x, 0 if it is not there.
+// If found, set *poff to byte offset of entry.
+static uint dirfind(struct diridx *x, char *name, uint *poff) {
+  int i;
+
+  for(i = x->head[namehash(name) & (x->nbucket - 1)]; i >= 0; i = x->next[i]){
+    if(namecmp(name, x->de[i].name) == 0){
       // entry matches path element
       if(poff)
-        *poff = off;
-      inum = de.inum;
-      //print_inodes(); // debug code
-      //struct inode *inod = iget(inum);   // debug code
-      //printf("inode->inum: %d\n", inod->inum); // debug code   
-      return iget(inum);
+        *poff = i * sizeof(struct dirent);
+      return x->de[i].inum;
     }
   }
-
   return 0;
 }
 
-// Write a new directory entry (name, inum) into the directory dp.
-int dirlink(struct inode *dp, char *name, uint inum) { int off;
+// Look for a directory entry in a directory. dp must be locked.
+// If found, set *poff to byte offset of entry.
+struct inode* dirlookup(struct inode *dp, char *name, uint *poff) {
+  struct diridx *x;
+  uint inum;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  x = diridxget(dp);
+  inum = dirfind(x, name, poff);
+  diridxput(x);
+  return inum ? iget(inum) : 0;
+}
+
+// Write a new directory entry (name, inum) into the directory dp,
+// which must be locked. Return -1 if name is already there or the
+// directory cannot grow.
+int dirlink(struct inode *dp, char *name, uint inum) {
+  struct diridx *x;
   struct dirent de;
-  struct inode *ip;
+  uint i;
+
+  x = diridxget(dp);
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(x, name, 0) != 0){
+    diridxput(x);
     return -1;
   }
 
   // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  for(i = x->freehint; i < x->n && x->de[i].inum != 0; i++)
+    ;
 
+  memset(&de, 0, sizeof(de));
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  if(writei(dp, (char*)&de, i * sizeof(de), sizeof(de)) != sizeof(de)){
+    diridxput(x);  // out of extents or disk space
+    return -1;
+  }
+  x->freehint = i + 1;
+
+  if(i == x->n){
+    diridxgrow(x, i + 1);
+    x->n++;
+  }
+  x->de[i] = de;
+  diridxhash(x, i);
+  diridxput(x);
+  dcenter(dp->inum, name, inum);
+  return 0;
+}
+
+// Clear the directory entry at byte offset off in dp,
+// which must be locked.
+void dirunlink(struct inode *dp, uint off) {
+  struct diridx *x;
+  struct dirent de;
+  char name[DIRSIZ];
+  uint i = off / sizeof(de);
+
+  // Get the index first: one built after the write would not have
+  // the name, and the name cache would keep it.
+  x = diridxget(dp);
+  memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
-  
+    panic("unlink: writei");
+
+  name[0] = 0;
+  if(i < x->n && x->de[i].inum){
+    diridxunhash(x, i);
+    x->de[i].inum = 0;
+    memmove(name, x->de[i].name, DIRSIZ);
+  }
+  if(i < x->freehint)
+    x->freehint = i;
+  diridxput(x);
+  if(name[0])
+    dcenter(dp->inum, name, 0);
+}
+
+/*
+ * Name cache.
+ * namex asks the name cache before it looks a path element up in a
+ * directory. An entry maps (directory inum, name) to the inum of the
+ * entry, or to 0 to record that the directory has no such name.
+ * dirlink and dirunlink keep it current, and so every caller that
+ * changes a directory - create, tfs_link and tfs_unlink - does too.
+ * NDCACHE entries are cached; a clock hand picks the entry to replace.
+ */
+#define NDCBUCKET 127
+
+struct dcentry {
+  uint dir;               // directory inum, 0 if entry unused
+  uint inum;              // 0 for a name known not to exist
+  char name[DIRSIZ];
+  struct dcentry *next;   // hash chain
+};
+static struct {
+  struct dcentry e[NDCACHE];
+  struct dcentry *hash[NDCBUCKET];
+  uint hand;
+  struct dcachestat stat;
+} dcache;
+
+static struct dcentry** dchash(uint dir, char *name) {
+  return &dcache.hash[(namehash(name) ^ dir) % NDCBUCKET];
+}
+
+// Find the entry for name in directory dir.
+static struct dcentry* dcfind(uint dir, char *name) {
+  struct dcentry *e;
+
+  for(e = *dchash(dir, name); e; e = e->next)
+    if(e->dir == dir && namecmp(e->name, name) == 0)
+      return e;
   return 0;
 }
 
+static void dcremove(struct dcentry *e) {
+  struct dcentry **p;
+
+  for(p = dchash(e->dir, e->name); *p; p = &(*p)->next)
+    if(*p == e){
+      *p = e->next;
+      break;
+    }
+  e->dir = 0;
+}
+
+// Record that name in directory dir is inode inum (0: no such name).
+static void dcenter(uint dir, char *name, uint inum) {
+  struct dcentry *e, **p;
+
+  pthread_mutex_lock(&dclock);
+  if((e = dcfind(dir, name)) == 0){
+    e = &dcache.e[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(e->dir)
+      dcremove(e);
+    e->dir = dir;
+    strncpy(e->name, name, DIRSIZ);
+    p = dchash(dir, name);
+    e->next = *p;
+    *p = e;
+  }
+  e->inum = inum;
+  pthread_mutex_unlock(&dclock);
+}
+
+// Look name up in directory dir, counting the hit or miss.
+// Return 1 and set *inum (0: no such name) if the cache knows.
+static int dclookup(uint dir, char *name, uint *inum) {
+  struct dcentry *e;
+
+  pthread_mutex_lock(&dclock);
+  if((e = dcfind(dir, name)) != 0){
+    *inum = e->inum;
+    if(e->inum)
+      dcache.stat.hits++;
+    else
+      dcache.stat.neghits++;
+  } else
+    dcache.stat.misses++;
+  pthread_mutex_unlock(&dclock);
+  return e != 0;
+}
+
+// Empty the cache, e.g. when a new file system is read.
+static void dcinit(void) {
+  memset(&dcache, 0, sizeof(dcache));
+}
+
+// Forget every name in directory dir, e.g. when dir is freed.
+static void dcpurge(uint dir) {
+  pthread_mutex_lock(&dclock);
+  for(int i = 0; i < NDCACHE; i++)
+    if(dcache.e[i].dir == dir)
+      dcremove(&dcache.e[i]);
+  pthread_mutex_unlock(&dclock);
+}
+
+// Copy out the name cache counters.
+void dcstat(struct dcachestat *st) {
+  pthread_mutex_lock(&dclock);
+  *st = dcache.stat;
+  pthread_mutex_unlock(&dclock);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -405,8 +1972,10 @@ static char* skipelem(char *path, char *name) {
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
+// The inode returned is not locked.
 static struct inode* namex(char *path, int nameiparent, char *name) {
   struct inode *ip, *next;
+  uint inum;
 
   if(*path == '/')
     ip = iget(ROOTINO);
@@ -415,16 +1984,25 @@ static struct inode* namex(char *path, int nameiparent, char *name) {
     ip = idup(curr_proc->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    ilock(ip);
     if(ip->type != T_DIR){
+      iunlockput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
+      iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      return 0;
+    if(dclookup(ip->inum, name, &inum))
+      next = inum ? iget(inum) : 0;
+    else {
+      next = dirlookup(ip, name, 0);
+      dcenter(ip->inum, name, next ? next->inum : 0);
     }
+    iunlockput(ip);
+    if(next == 0)
+      return 0;
     ip = next;
   }
   if(nameiparent){
@@ -1,14 +1,18 @@
 /*
  * On-disk file system format currently implemented for tinyfs
+ * Blocks are BSIZE bytes, a power of two from MINBSIZE to MAXBSIZE
+ * chosen when the image is created and recorded in the super block.
  * Block 0 is unused.
  * Block 1 is super block.
- * Block 2 inode bitmap - not used, inodes are free if type == 0
- * Block 3 data block bitmap
- * Blocks 4 through 7 hold inodes
+ * Block 2 inode bitmap - bit i set if inode i is in use (inode 0 is never used)
+ * Block 3 data block bitmap, or with SB_BGROUP the first of NBMAP(sb.size)
+ *  bitmap blocks from sb.bmapstart; more than one follow the inodes and log
+ * Blocks 4 through 4 + NIBLOCKS(sb.ninodes) - 1 hold inodes
  *  sizeof(inode) is 64 bytes
- *  8 inodes per block
- *  4 blocks of inodes yields 32 files on disk.
- * Blocks 8 to sb.nblocks are data blocks
+ *  8 inodes per 512 byte block
+ *  createfs picks sb.ninodes, up to BPB; the demo uses 32 (4 blocks).
+ * With SB_LOG, sb.nlog log blocks from sb.logstart follow the inodes - see log.c
+ * The last sb.nblocks blocks are data blocks
  *
  * The next 4 lines are descriptions from original Xv6 fs.h
  * Blocks 2 through sb.ninodes/IPB hold inodes.
@@ -18,7 +22,10 @@
  */
 
 #define ROOTINO 1        // root i-number
-#define BSIZE 512        // block size
+#define MINBSIZE 512     // smallest block size, and the default
+#define MAXBSIZE 65536   // largest block size
+#define BSIZE (1u << bshift)  // block size of the image - see setbsize
+extern uint bshift;
 #define NBLOCKS 1024     // number of blocks in file system
 #define FSNAME "tinyfs"  // File system name
 
@@ -27,38 +34,72 @@ struct superblock {
   uint size;         // Size of file system image (blocks)
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
-  uint nlog;         // Number of log blocks - not used in tinyfs
+  uint nlog;         // Number of log blocks, 0 if there is no log
   char name[12];     // name of file system
+  uint flags;        // SB_* format options chosen by createfs
+  uint logstart;     // Block number of first log block
+  uint bsize;        // Block size in bytes, 0 in images older than it (512)
+  uint bmapstart;    // Block number of first data bitmap block
 };
 
-// tinyfs files are small. They can be 8 blocks (512 bytes per block)
+#define SB_DINDIRECT 0x1  // inodes have a double indirect block
+#define SB_EXTENT    0x2  // inodes map data with extents (overrides SB_DINDIRECT)
+#define SB_IBITMAP   0x4  // block 2 marks the inodes in use; without it
+                          // readfsinfo rebuilds the bitmap from the inodes
+#define SB_LOG       0x8  // metadata and data go through a redo log
+#define SB_BGROUP    0x10 // the data bitmap has a bit for every block, in
+                          // NBMAP(sb.size) blocks from sb.bmapstart; without
+                          // it block 3 covers the first BPB blocks
+#define SB_UNWRITTEN 0x20 // dinode.unwritten is kept; without it
+                          // readfsinfo clears the field first
+
+// Log blocks createfs reserves for SB_LOG: two slots, each a header
+// block and LOGSIZE blocks (param.h) - see log.c
+#define LOGBLOCKS (2 * (1 + LOGSIZE))
+
+// An inode lists NDIRECT direct blocks, then in blocks[NDIRECT] a single
+// indirect block holding the addresses of the next NINDIRECT blocks.
 #define NDIRECT 8
-// tinyfs does not implement NINDIRECT, indirect blocks allow a file to expand
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
+// With SB_DINDIRECT, blocks[NDIRECT-1] is the single indirect block and
+// blocks[NDIRECT] a double indirect block of NINDIRECT indirect blocks.
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE_DIND (NDIRECT-1 + NINDIRECT + NDINDIRECT)
+
+// With SB_EXTENT, blocks[0..NDIRECT-1] hold NIEXTENT extents, each a run
+// of len blocks starting at block start, and blocks[NDIRECT] is an extent
+// block holding NXEXTENT more.
+struct extent {
+  uint start;
+  uint len;
+};
+#define NIEXTENT (NDIRECT / 2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
 
 /*
- * inode structure - Xv6 has an ondisk inode and an in-memory inode. tinyfs has one inode structure
- * sizeof(inode) is 64, which allows for 8 inodes per 512 byte disk block
- * tinyfs allocates blocks 4-7 for inodes. tinyfs accomodates 32 files
- * If new members are added to struct inode and sizeof(struct inode) changes, you have to rethink disk layout
+ * On-disk inode structure - like Xv6, tinyfs has an ondisk inode (struct dinode)
+ * and an in-memory inode (struct inode in file.h).
+ * sizeof(dinode) is 64, which allows for 8 inodes per 512 byte disk block
+ * tinyfs allocates blocks from 4 on for inodes, 8 per block
+ * If new members are added to struct dinode and sizeof(struct dinode) changes, you have to rethink disk layout
  *
  * Xv6 has a cache of in-memory inodes. inodes on the disk are read into the cache.
- * The in-memory inode structure has a ref member that counts the number of files referring to the in-memory inode.
- * tinyfs retains the ref member in order for the Xv6 code to work.
- * The function iget expectes ref to be non-zero to properly find an inode structure for an inode number
- * When tinyfs reads the intial inodes from disk, tinyfs sets ref to be equal to nlink.
- * This allows iget to work properly
+ * tinyfs does the same: iget reads an inode from its block on first use into
+ * one of NINODE cache entries, and iupdate copies a changed inode back to its block.
+ * The ref member of the in-memory inode counts the references to the cache entry.
+ * The unused member is where earlier tinyfs images kept ref; it is ignored.
  * A unit is 4 bytes. 
- * A struct inode has 7 members that are type uint - 28 bytes
- * A struct inode has a uint blocks[] that has 9 elements - 36 bytes
- * A struct inode is 64 bytes
+ * A struct dinode has 7 members that are type uint - 28 bytes
+ * A struct dinode has a uint blocks[] that has 9 elements - 36 bytes
+ *   the last one (two with SB_DINDIRECT) name indirect blocks
+ * A struct dinode is 64 bytes
  */
-struct inode {
+struct dinode {
   uint type;     // File type - dir, file
   uint nlink;    // Number of links to inode in file system
   uint size;     // Size of file (bytes)
-  uint ref;      // references to inode HERE
+  uint unwritten;  // 1 + first block never written since ifallocate, or 0
   uint inum;     // inode number
   //uint uid;      // user id
   //uint gid;      // group id
@@ -68,16 +109,26 @@ struct inode {
 };
 
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct inode))
+#define IPB           (BSIZE / sizeof(struct dinode))
+
+// First inode block
+#define INODESTART    4
 
 // Block containing inode i
-#define IBLOCK(i)     ((i) / IPB + 2)
+#define IBLOCK(i)     ((i) / IPB + INODESTART)
+
+// Number of blocks holding n inodes
+#define NIBLOCKS(n)   (((n) + IPB - 1) / IPB)
 
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
 // Block containing bit for block b
-#define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
+#define BBLOCK(b, sb) ((b)/BPB + (sb).bmapstart)
+
+// Bitmap blocks for an image of size blocks. Each one covers an
+// allocation group of BPB blocks - see balloc.
+#define NBMAP(size)   (((size) + BPB - 1) / BPB)
 
 /*
  * A directory is a file containing a sequence of dirent structures.
@@ -6,33 +6,34 @@
 #include <time.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "fs.h"
 
 /*
  * $ hexdump -s10 -l3 file
  * hexdump shows hex values of tiny file system blocks
- * hexdump shows hex valuse of any file in 512 byte blocks
+ * hexdump shows hex valuse of any file in blocks of the size its
+ * superblock records, or 512 bytes if it has none
  * -s10 is the start block, -s must include a number
  * -l3 is the number of blocks, -l must include a number
  * file is the tiny file system
  */
 
-#define BSIZE 512
-
-#define uint unsigned int
-
 void panic(char *s) {
     printf("%s\n", s);
     exit(1);
 }
 
-int blocks = 10, start_block = 0;
+int blocks = 10, start_block = 0, inode_blocks = 0;
 char filename[100];
 
 void panic();
 
 int get_opts(int count, char *args[]) {
     int opt, len, i, good = 1;
-    while (good && (opt = getopt(count, args, "s:l:i:")) != -1) {
+    while (good && (opt = getopt(count, args, "s:l:i")) != -1) {
         int len, i;
         switch (opt) {
             case 's':
@@ -59,8 +60,7 @@ int get_opts(int count, char *args[]) {
                 break;
             //NEW FLAG ADDITION
             case 'i':
-                start_block = 4;//Start at inode block
-                blocks = 4;//End four blocks down to illustrate all inode spaces.
+                inode_blocks = 1;//Block range comes from the superblock once the file is open
                 printf("Inode blocks:\n");
                 break;
             case ':':
@@ -91,28 +91,60 @@ int get_opts(int count, char *args[]) {
 }
 
 int fs;
-
-int bread(uint block, unsigned char *buf) {
-    int off = lseek(fs, block*BSIZE, SEEK_SET);
-    if (off < 0)
-        panic("bread lseek fail");
-    //printf("off : %d\n", off);
-    memset(buf, 0, BSIZE);
-    int sz = read(fs, buf, BSIZE);
-    if (sz < 0)
-        panic("bread read fail");
-    //printf("sz : %d\n", sz);
+uint bshift = 9;       // BSIZE is 1 << bshift, found by openfs
+unsigned char *fsmap;  // the whole file, mapped by openfs
+size_t fsmapsize;
+
+// Point *buf at block in the mapped file. A short last block is
+// copied into zero-filled scratch so a full block can be printed.
+// Returns the number of bytes of the file in the block.
+int bread(uint block, unsigned char **buf) {
+    static unsigned char tail[MAXBSIZE];
+    size_t off = (size_t)block*BSIZE;
+    if (off >= fsmapsize)
+        return 0;
+    int sz = fsmapsize - off < BSIZE ? fsmapsize - off : BSIZE;
+    if (sz < BSIZE) {
+        memset(tail, 0, BSIZE);
+        memcpy(tail, fsmap + off, sz);
+        *buf = tail;
+    } else
+        *buf = fsmap + off;
     return sz;
 }
 
 int openfs(char *name) {
-    fs = open(name, O_RDWR, S_IRUSR | S_IWUSR);
+    struct stat st;
+    fs = open(name, O_RDONLY);
     if (fs < 0)
         panic("openfs open fail");
+    if (fstat(fs, &st) < 0)
+        panic("openfs fstat fail");
+    fsmapsize = st.st_size;
+    if (fsmapsize > 0) {
+        fsmap = mmap(0, fsmapsize, PROT_READ, MAP_SHARED, fs, 0);
+        if (fsmap == MAP_FAILED)
+            panic("openfs mmap fail");
+    }
+    // Find the block size as bio.c does: the superblock in block 1
+    // records it, and images from before it was recorded use 512.
+    for (uint s = 9; (1u << s) <= MAXBSIZE; s++) {
+        struct superblock sb;
+        size_t off = (size_t)1 << s;
+        if (off + sizeof(sb) > fsmapsize)
+            break;
+        memcpy(&sb, fsmap + off, sizeof(sb));
+        if (sb.bsize == off || (off == MINBSIZE && sb.bsize == 0 && sb.size != 0)) {
+            bshift = s;
+            break;
+        }
+    }
     return 0;
 }
 
 int closefs() {
+    if (fsmapsize > 0)
+        munmap(fsmap, fsmapsize);
     close(fs);
     return 0;
 }
@@ -128,9 +160,18 @@ int main(int argc, char *argv[]) {
 
     openfs(filename);
 
-    unsigned char buf[BSIZE];
+    unsigned char *buf;
+    if (inode_blocks) {
+        // Show every inode block the superblock says there are
+        struct superblock sb;
+        if (bread(1, &buf) == 0)
+            panic("no superblock");
+        memcpy(&sb, buf, sizeof(sb));
+        start_block = INODESTART;
+        blocks = NIBLOCKS(sb.ninodes);
+    }
     for (int i = start_block; i < start_block + blocks; i++) {
-        if (bread(i, buf) > 0) {
+        if (bread(i, &buf) > 0) {
             printf("block: %05d: \n", i);
             for (int j = 0; j < BSIZE/LINE; j++) {
                 printf("0x%08x  ", i*BSIZE+j*LINE);
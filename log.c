@@ -0,0 +1,375 @@
+//
+// Redo log, adapted from Xv6 log.c, for file systems made with SB_LOG.
+//
+// A log transaction contains the updates of multiple FS system
+// calls. The logging system only commits when there are
+// no FS system calls active. Thus there is never
+// any reasoning required about whether a commit might
+// write an uncommitted system call's updates to disk.
+//
+// A system call should call begin_op()/end_op() to mark
+// its start and end. Usually begin_op() just increments
+// the count of in-progress FS system calls and returns.
+// But if it thinks the log is close to running out, it
+// sleeps until the last outstanding end_op() commits.
+// So calls from many threads are committed together (group commit):
+// one sequential write of the log and one fsync for all of them.
+//
+// The space begin_op reserves for an op covers MAXOPBLOCKS blocks and
+// the LOGGROUPS data bitmap blocks the op may change (log_groups),
+// which the commit adds. A log made with a smaller LOGSIZE, by an older
+// build, still works; it just batches fewer ops.
+//
+// Code changes a block by calling log_write instead of bwrite.
+// log_write records the block number and pins the buffer in the
+// cache, so it cannot reach its home location before the commit.
+// Without a log, log_write is bwrite and begin_op/end_op do nothing.
+//
+// The on-disk log has two slots of a header block followed by
+// LOGSIZE logged blocks. Commits alternate between the slots:
+//   header block, containing block #s for block A, B, C, ...
+//   block A
+//   block B
+//   block C
+//   ...
+// A commit writes its slot with one pwritev and fsyncs. It then writes
+// the blocks to their home locations without waiting, and the next
+// commit's fsync makes those writes durable before the slot after it
+// is reused. The header carries a sequence number and a checksum of the
+// slot, so recovery replays every complete slot, oldest first, and
+// ignores one whose write was torn. After a clean unmount both headers
+// are clear (log_checkpoint), so there is nothing to replay.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "buf.h"
+
+extern int fs;
+extern uchar *fsmap;
+extern struct superblock sb;
+
+// Contents of the header block, used for both the on-disk header block
+// and to keep track in memory of logged block# before commit.
+struct logheader {
+  uint n;
+  uint seq;   // commit number; slot seq%2
+  uint sum;   // checksum of the rest of the header and the blocks
+  uint block[LOGSIZE];
+};
+
+struct log {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int start;       // first block of slot 0
+  int size;        // blocks per slot, header included; 0 if no log
+  int outstanding; // how many FS sys calls are executing.
+  int committing;  // in commit(), please wait.
+  int ngroups;     // data bitmap blocks the commit will add, see log_group
+  int dirty;       // a slot holds a commit - see log_checkpoint
+  struct logheader lh;
+};
+static struct log log = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static __thread uint opgroups;  // bitmap blocks this thread's op may still add
+
+static void recover_from_log(void);
+static void commit();
+static void clear_slots(void);
+
+static uint slotstart(uint seq) {
+  return log.start + (seq % 2) * log.size;
+}
+
+static uint checksum(struct logheader *lh, uchar **data) {
+  uint sum = lh->n * 31 + lh->seq;
+
+  for(uint i = 0; i < lh->n; i++){
+    sum = sum * 31 + lh->block[i];
+    for(uint k = 0; k < BSIZE; k += 4)
+      sum = sum * 31 + *(uint*)(data[i] + k);
+  }
+  return sum;
+}
+
+// Set up the log of the file system readfsinfo just read,
+// replaying any committed transactions into place.
+void initlog(void) {
+  if (sizeof(struct logheader) >= BSIZE)
+    panic("initlog: too big logheader");
+
+  log.size = sb.nlog / 2;
+  log.start = sb.logstart;
+  log.outstanding = log.committing = log.dirty = 0;
+  log.lh.n = 0;
+  if(log.size == 0)
+    return;
+  if(fsmap)
+    panic("initlog: log needs openfs, not openfs_mmap");
+  if(log.size > 1 + LOGSIZE || log.size - 1 < MAXOPBLOCKS + 2 + 2*LOGGROUPS)
+    panic("initlog: log size");
+  recover_from_log();
+}
+
+// Read the slot starting at block start into lh and data.
+// Return 1 if it holds a complete commit.
+static int read_slot(uint start, struct logheader *lh, uchar **data) {
+  uchar hb[BSIZE];
+
+  if(pread(fs, hb, BSIZE, (off_t)start * BSIZE) != BSIZE)
+    return 0;
+  memmove(lh, hb, sizeof(*lh));
+  if(lh->n == 0 || lh->n >= log.size)
+    return 0;
+  for(uint i = 0; i < lh->n; i++)
+    if(pread(fs, data[i], BSIZE, (off_t)(start + 1 + i) * BSIZE) != BSIZE)
+      return 0;
+  return checksum(lh, data) == lh->sum;
+}
+
+// Copy committed blocks from a slot to their home location.
+static void install_slot(struct logheader *lh, uchar **data) {
+  struct buf *b;
+
+  for(uint i = 0; i < lh->n; i++){
+    b = bget(lh->block[i]);
+    memmove(b->data, data[i], BSIZE);
+    bwrite(b);
+    brelse(b);
+  }
+}
+
+// Replay complete slots, older first, then clear both headers.
+static void recover_from_log(void) {
+  struct logheader lh[2];
+  uchar *data[2][LOGSIZE];
+  int ok[2], first;
+
+  for(int s = 0; s < 2; s++){
+    for(int i = 0; i < LOGSIZE; i++)
+      if((data[s][i] = malloc(BSIZE)) == 0)
+        panic("recover_from_log: out of memory");
+    ok[s] = read_slot(log.start + s * log.size, &lh[s], data[s]);
+  }
+  first = ok[0] && ok[1] && lh[1].seq < lh[0].seq;
+  for(int k = 0; k < 2; k++){
+    int s = first ? 1 - k : k;
+    if(ok[s])
+      install_slot(&lh[s], data[s]);
+  }
+  log.lh.seq = 0;
+  for(int s = 0; s < 2; s++)
+    if(ok[s] && lh[s].seq + 1 > log.lh.seq)
+      log.lh.seq = lh[s].seq + 1;
+  if(ok[0] || ok[1])
+    clear_slots();
+  for(int s = 0; s < 2; s++)
+    for(int i = 0; i < LOGSIZE; i++)
+      free(data[s][i]);
+}
+
+// Make the installed blocks durable, then erase both slot headers.
+static void clear_slots(void) {
+  uchar zero[BSIZE];
+
+  bsync();
+  memset(zero, 0, BSIZE);
+  for(int s = 0; s < 2; s++)
+    if(pwrite(fs, zero, BSIZE, (off_t)(log.start + s * log.size) * BSIZE) != BSIZE)
+      panic("clear_slots: write");
+  if(fsync(fs) < 0)
+    panic("clear_slots: fsync");
+}
+
+// Called by writefsinfo once its changes are committed. If a slot
+// still holds a commit, wait for other threads' ops to finish, hold
+// off new ones, and clear the slots, so the next mount replays
+// nothing and a read-only run does not write the image.
+void log_checkpoint(void) {
+  if(log.size == 0)
+    return;
+  pthread_mutex_lock(&log.lock);
+  while(log.committing || log.outstanding > 0)
+    pthread_cond_wait(&log.cond, &log.lock);
+  if(!log.dirty){
+    pthread_mutex_unlock(&log.lock);
+    return;
+  }
+  log.committing = 1;
+  pthread_mutex_unlock(&log.lock);
+  clear_slots();
+  pthread_mutex_lock(&log.lock);
+  log.committing = 0;
+  log.dirty = 0;
+  pthread_cond_broadcast(&log.cond);
+  pthread_mutex_unlock(&log.lock);
+}
+
+// called at the start of each FS system call.
+void begin_op(void) {
+  if(log.size == 0)
+    return;
+  pthread_mutex_lock(&log.lock);
+  while(1){
+    if(log.committing){
+      pthread_cond_wait(&log.cond, &log.lock);
+    } else if(log.lh.n + log.ngroups + (log.outstanding+1)*(MAXOPBLOCKS+LOGGROUPS)
+              + 2 + LOGGROUPS > log.size - 1){
+      // this op might exhaust log space, counting the super block,
+      // inode bitmap and deferred frees the commit adds; wait for commit.
+      pthread_cond_wait(&log.cond, &log.lock);
+    } else {
+      log.outstanding += 1;
+      pthread_mutex_unlock(&log.lock);
+      opgroups = LOGGROUPS;
+      break;
+    }
+  }
+}
+
+// called at the end of each FS system call.
+// commits if this was the last outstanding operation.
+void end_op(void) {
+  int do_commit = 0;
+
+  if(log.size == 0)
+    return;
+  pthread_mutex_lock(&log.lock);
+  log.outstanding -= 1;
+  if(log.committing)
+    panic("log.committing");
+  if(log.outstanding == 0){
+    do_commit = 1;
+    log.committing = 1;
+  } else {
+    // begin_op() may be waiting for log space,
+    // and decrementing log.outstanding has decreased
+    // the amount of reserved space.
+    pthread_cond_broadcast(&log.cond);
+  }
+  pthread_mutex_unlock(&log.lock);
+
+  if(do_commit){
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    opgroups = LOGGROUPS;  // for the deferred frees logfsinfo applies
+    logfsinfo();  // the super block and bitmaps join the transaction
+    commit();
+    pthread_mutex_lock(&log.lock);
+    log.committing = 0;
+    log.ngroups = 0;
+    pthread_cond_broadcast(&log.cond);
+    pthread_mutex_unlock(&log.lock);
+  }
+}
+
+static int sectorcmp(const void *a, const void *b) {
+  uint x = (*(struct buf **)a)->sector, y = (*(struct buf **)b)->sector;
+  return x < y ? -1 : x > y;
+}
+
+// Write the transaction to its slot, make it durable, then send the
+// blocks home, adjacent ones together, and unpin them.
+static void commit() {
+  struct buf *bp[LOGSIZE];
+  struct iovec iov[1 + LOGSIZE];
+  uchar hb[BSIZE];
+  uchar *data[LOGSIZE];
+  uint n = log.lh.n, i, j;
+
+  if(n == 0)
+    return;
+  for(i = 0; i < n; i++){
+    bp[i] = bget(log.lh.block[i]);  // pinned, so still cached
+    data[i] = bp[i]->data;
+  }
+  log.lh.sum = checksum(&log.lh, data);
+  memset(hb, 0, BSIZE);
+  memmove(hb, &log.lh, sizeof(log.lh));
+  iov[0].iov_base = hb;
+  iov[0].iov_len = BSIZE;
+  for(i = 0; i < n; i++){
+    iov[1+i].iov_base = data[i];
+    iov[1+i].iov_len = BSIZE;
+  }
+  if(pwritev(fs, iov, 1 + n, (off_t)slotstart(log.lh.seq) * BSIZE) != (1 + n) * BSIZE)
+    panic("commit: write log");
+  if(fsync(fs) < 0)  // the commit point
+    panic("commit: fsync");
+  log.dirty = 1;
+
+  // Install. The other slot is reused only after the next commit's
+  // fsync, which makes these writes durable too.
+  qsort(bp, n, sizeof(struct buf *), sectorcmp);
+  for(i = 0; i < n; i = j){
+    for(j = i+1; j < n && j-i < MAXBIO && bp[j]->sector == bp[j-1]->sector + 1; j++)
+      ;
+    bwritev(bp + i, j - i);
+  }
+  for(i = 0; i < n; i++){
+    bunpin(bp[i]);
+    brelse(bp[i]);
+  }
+  log.lh.n = 0;
+  log.lh.seq++;
+}
+
+// Caller has modified b->data and is done with the buffer.
+// Record the block number and pin in the cache with B_LOG.
+// commit()/install then does the real write.
+// log_write() replaces bwrite(); a typical use is:
+//   bp = bread(...)
+//   modify bp->data[]
+//   log_write(bp)
+//   brelse(bp)
+void log_write(struct buf *b) {
+  uint i;
+
+  if(log.size == 0){
+    bwrite(b);
+    return;
+  }
+  pthread_mutex_lock(&log.lock);
+  if(log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+    panic("too big a transaction");
+  if(log.outstanding < 1 && !log.committing)
+    panic("log_write outside of trans");
+
+  for(i = 0; i < log.lh.n; i++){
+    if(log.lh.block[i] == b->sector)   // log absorbtion
+      break;
+  }
+  log.lh.block[i] = b->sector;
+  if(i == log.lh.n)
+    log.lh.n++;
+  pthread_mutex_unlock(&log.lock);
+  bpin(b);
+  bwrite(b);
+}
+
+// How many more data bitmap blocks the calling thread's op may change;
+// balloc and bfree stay within them. Unlimited without a log.
+uint log_groups(void) {
+  return log.size == 0 ? ~0u : opgroups;
+}
+
+// The calling thread's op changes one more data bitmap block, which
+// the commit will log.
+void log_group(void) {
+  if(log.size == 0)
+    return;
+  if(opgroups == 0)
+    panic("log_group: op changes too many bitmap blocks");
+  opgroups--;
+  pthread_mutex_lock(&log.lock);
+  log.ngroups++;
+  pthread_mutex_unlock(&log.lock);
+}
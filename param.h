@@ -3,11 +3,23 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
+#define NBUF        160  // default size of disk block cache
+#define MAXBIO       16  // max blocks moved by one breadv/bwritev
+#define NIOTHREAD     4  // max I/O threads serving the disk queue
+#define NPLAN       256  // max file blocks readi/writei map at once
+#define RAMIN         4  // first readahead window of a sequential reader
+#define RAMAX        64  // largest readahead window, in blocks
+#define DIRTYAGE   5000  // ms a buffer may stay dirty under bflusher
+#define DIRTYPCT     50  // % of the cache dirty before bflusher writes all
 #define NINODE       50  // maximum number of active i-nodes
+#define NDIRIDX      16  // directories with an in-memory lookup index
+#define NDCACHE     256  // entries in the path name cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define LOGSIZE      10  // max data sectors in on-disk log
+#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define LOGGROUPS     4  // max data bitmap blocks any FS op changes
+#define LOGSIZE     120  // max data sectors in on-disk log
+                             // NBUF must exceed LOGSIZE + MAXBIO
 #define CWD          12  // 12 character CWD
 #define PNAME         8  //  8 character process name
@@ -19,7 +19,8 @@ struct cpu {
 extern struct cpu cpus[NCPU];
 
 #define curr_cpu (&cpus[0])
-#define curr_proc   (cpus[0].proc)
+// Each thread using tinyfs sets its own curr_proc (defined in bio.c).
+extern __thread struct proc *curr_proc;
 
 struct context {
   uint r4;
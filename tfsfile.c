@@ -72,6 +72,17 @@ int tfs_close(int fd) {
   return 0;
 }
 
+// Reserve disk blocks for bytes [off, off+len) of the file open on fd,
+// in as few runs as the free space allows, so later writes there do no
+// allocation. The blocks read as zeros until written. Unless flags has
+// TF_KEEPSIZE, the file grows to off+len.
+int tfs_fallocate(int fd, int off, int len, int flags) {
+  struct file *f;
+  if (fd_to_file(fd, &f) < 0 || off < 0 || len < 0)
+    return -1;
+  return fileallocate(f, off, len, flags);
+}
+
 int tfs_fstat(int fd, struct tfs_stat *st) {
   struct file *f;
   if (fd_to_file(fd, &f) < 0)
@@ -84,30 +95,48 @@ int tfs_link(char *old, char *new) {
   char name[DIRSIZ];
   struct inode *dp, *ip;
 
-  if((ip = namei(old)) == 0)
+  begin_op();
+  if((ip = namei(old)) == 0){
+    end_op();
     return -1;
+  }
 
-  if(ip->type == T_DIR)
+  ilock(ip);
+  if(ip->type == T_DIR){
+    iunlockput(ip);
+    end_op();
     return -1;
+  }
 
   ip->nlink++;
-  //iupdate(ip);
+  iupdate(ip);
+  iunlock(ip);
 
   if((dp = nameiparent(new, name)) == 0)
     goto bad;
-  if(dirlink(dp, name, ip->inum) < 0)
+  ilock(dp);
+  if(dirlink(dp, name, ip->inum) < 0){
+    iunlockput(dp);
     goto bad;
+  }
+  iunlockput(dp);
   iput(ip);
 
+  end_op();
+
   return 0;
 
 bad:
+  ilock(ip);
   ip->nlink--;
-  //iupdate(ip);
+  iupdate(ip);
+  iunlockput(ip);
+  end_op();
   return -1;
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// dp must be locked.
 static int isdirempty(struct inode *dp) {
   int off;
   struct dirent de;
@@ -124,38 +153,55 @@ static int isdirempty(struct inode *dp) {
 //PAGEBREAK!
 int tfs_unlink(char *path) {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ];
   uint off;
 
-  if((dp = nameiparent(path, name)) == 0)
+  begin_op();
+  if((dp = nameiparent(path, name)) == 0){
+    end_op();
     return -1;
+  }
+
+  ilock(dp);
 
   // Cannot unlink "." or "..".
   if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
-    return -1;
+    goto bad;
 
   if((ip = dirlookup(dp, name, &off)) == 0)
-    return -1;
+    goto bad;
+  ilock(ip);
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip))
-    return -1;
+  if(ip->type == T_DIR && !isdirempty(ip)){
+    iunlockput(ip);
+    goto bad;
+  }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, off);
   if(ip->type == T_DIR){
     dp->nlink--;
-    //iupdate(dp);
+    iupdate(dp);
   }
+  iunlockput(dp);
 
   ip->nlink--;
-  //iupdate(ip);
+  iupdate(ip);
+  iunlockput(ip);
+
+  end_op();
+
   return 0;
+
+bad:
+  iunlockput(dp);
+  end_op();
+  return -1;
 }
 
+// Create path as a new inode of the given type.
+// Returns it locked, or 0.
 static struct inode* create(char *path, short type) {
   uint off;
   struct inode *ip, *dp;
@@ -163,30 +209,46 @@ static struct inode* create(char *path, short type) {
 
   if((dp = nameiparent(path, name)) == 0)
     return 0;
+  ilock(dp);
 
   if((ip = dirlookup(dp, name, &off)) != 0){
+    iunlockput(dp);
+    ilock(ip);
     if(type == T_FILE && ip->type == T_FILE)
       return ip;
+    iunlockput(ip);
     return 0;
   }
 
-  if((ip = ialloc(type)) == 0)
+  if((ip = ialloc(type, dp->inum)) == 0)
     panic("create: ialloc");
 
+  ilock(ip);
   ip->nlink = 1;
-  //iupdate(ip);
+  iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
     dp->nlink++;  // for ".."
-    // iupdate(dp); // not nteeded - update inodes on disk on exit
+    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp is out of extents or disk space: give the new inode back.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
+  iunlockput(dp);
   return ip;
 }
 
@@ -195,14 +257,23 @@ int tfs_open(char *path, int flags, int mode) {
   struct file *f;
   struct inode *ip;
 
+  begin_op();
+
   if(flags & TO_CREATE){
     ip = create(path, T_FILE);
-    if(ip == 0)
+    if(ip == 0){
+      end_op();
       return -1;
+    }
   } else {
-    if((ip = namei(path)) == 0)
+    if((ip = namei(path)) == 0){
+      end_op();
       return -1;
+    }
+    ilock(ip);
     if(ip->type == T_DIR && flags != TO_RDONLY){
+      iunlockput(ip);
+      end_op();
       return -1;
     }
   }
@@ -210,12 +281,17 @@ int tfs_open(char *path, int flags, int mode) {
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
+    iunlockput(ip);
+    end_op();
     return -1;
   }
+  iunlock(ip);
+  end_op();
 
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
+  f->raoff = f->rawin = f->raend = 0;
   f->readable = !(flags & TO_WRONLY);
   f->writable = (flags & TO_WRONLY) || (flags & TO_RDWR);
   return fd;
@@ -223,20 +299,44 @@ int tfs_open(char *path, int flags, int mode) {
 
 int tfs_mkdir(char *path) {
   struct inode *ip;
-  if ((ip = create(path, T_DIR)) == 0)
+
+  begin_op();
+  if ((ip = create(path, T_DIR)) == 0){
+    end_op();
     return -1;
+  }
+  iunlockput(ip);
+  end_op();
   return 0;
 }
 
 int tfs_chdir(char *path) {
   struct inode *ip;
 
-  if((ip = namei(path)) == 0)
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
     return -1;
+  }
+  ilock(ip);
   if(ip->type != T_DIR){
+    iunlockput(ip);
+    end_op();
     return -1;
   }
+  iunlock(ip);
   iput(curr_proc->cwd);
+  end_op();
   curr_proc->cwd = ip;
   return 0;
 }
+
+// Write everything that changed to disk: the super block and bitmaps
+// if they changed, then the dirty blocks in the buffer cache, with
+// adjacent blocks written together by one pwritev.
+// With a log, writefsinfo commits them and the rest is already logged.
+int tfs_sync(void) {
+  writefsinfo();
+  bsync();
+  return 0;
+}
@@ -12,4 +12,6 @@ int tfs_link(char*, char*);
 int tfs_mkdir(char*);
 int tfs_chdir(char*);
 int tfs_dup(int);
+int tfs_sync(void);
+int tfs_fallocate(int, int, int, int);
 